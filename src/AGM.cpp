@@ -1,238 +1,1270 @@
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
 
 #include "AGM.h"
+#include "noise.h"
 
-template <typename T, int peak>
-AVS_FORCEINLINE float average_plane_c(const T* srcp, const int src_pitch, const int width, const int height) noexcept
+constexpr float curve(const float x) noexcept
+{
+    return 1.0f - (x * ((x * ((x * ((x * ((x * 18.188f) - 45.47f)) + 36.624f)) - 9.466f)) + 1.124f));
+}
+
+template <int bits>
+struct curve_lut
+{
+    float data[1 << bits];
+
+    constexpr curve_lut() noexcept : data()
+    {
+        constexpr float peak{ (1 << bits) - 1 };
+
+        for (int i{ 0 }; i < (1 << bits); ++i)
+            data[i] = curve(i / peak);
+    }
+};
+
+// One polynomial LUT per bit depth for the whole process.
+// 8/10-bit are generated at compile time, the larger ones are built by the first instance that needs them.
+template <int bits>
+const float* shared_lut() noexcept
+{
+    if constexpr (bits <= 10)
+    {
+        static constexpr curve_lut<bits> lut;
+        return lut.data;
+    }
+    else
+    {
+        static const std::unique_ptr<const curve_lut<bits>> lut{ std::make_unique<curve_lut<bits>>() };
+        return lut->data;
+    }
+}
+
+template <typename T, int peak, bool range>
+AVS_FORCEINLINE double sum_plane_c(const T* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept
 {
     typedef typename std::conditional < sizeof(T) == 4, float, int64_t>::type sum_t;
-    sum_t accum{ 0 }; // int32 holds sum of maximum 16 Mpixels for 8 bit, and 65536 pixels for uint16_t pixels
+    sum_t accum{ 0 };
+    T lo{ std::numeric_limits<T>::max() };
+    T hi{ std::numeric_limits<T>::lowest() };
 
     for (size_t y{ 0 }; y < height; ++y)
     {
         for (size_t x{ 0 }; x < width; ++x)
+        {
             accum += srcp[x];
 
+            if constexpr (range)
+            {
+                lo = std::min(lo, srcp[x]);
+                hi = std::max(hi, srcp[x]);
+            }
+        }
+
         srcp += src_pitch;
     }
 
-    if constexpr (std::is_integral_v<T>)
-        return (static_cast<float>(accum) / (height * width)) / peak;
-    else
-        return accum / (height * width);
+    if constexpr (range)
+    {
+        minmax[0] = static_cast<float>(lo);
+        minmax[1] = static_cast<float>(hi);
+    }
+
+    return static_cast<double>(accum);
 }
 
-template <typename T, bool fade, int peak, int ymin, int y1, int y2, int ymax, int d0, int d1>
-void process_c(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept
+template <typename T, int peak>
+double sum_c(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept
 {
-    const int height{ src->GetHeight() };
+    return sum_plane_c<T, peak, false>(reinterpret_cast<const T*>(srcp), src_pitch / sizeof(T), width, height, nullptr);
+}
+
+template <typename T, int peak>
+double sum_range_c(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept
+{
+    return sum_plane_c<T, peak, true>(reinterpret_cast<const T*>(srcp), src_pitch / sizeof(T), width, height, minmax);
+}
+
+// histogram() counts into histogram_ways(bits) interleaved sub-histograms of up to 4096 bins; histogram_size() is the buffer length.
+constexpr int histogram_ways(const int bits) noexcept
+{
+    return (bits == 8) ? 8 : 4;
+}
+
+constexpr size_t histogram_size(const int bits) noexcept
+{
+    return static_cast<size_t>(histogram_ways(bits)) << std::min(bits, 12);
+}
 
-    env->BitBlt(dst->GetWritePtr(), dst->GetPitch(), src->GetReadPtr(), src->GetPitch(), src->GetRowSize(), height);
+// Counts the samples into hist: one bin per value up to 12-bit, the top 12 bits for 14/16-bit and 4096 steps over [0, 1] for float.
+// hist holds histogram_ways(bits) sub-histograms that consecutive samples go to in turn, so a run of equal samples doesn't wait on
+// the previous store to the same counter. Nothing is cleared or merged here: the caller zeroes the buffer once per frame and
+// merge_histograms() adds the sub-histograms up, so calling this for every block costs no more than calling it once.
+// 8-bit samples are read eight at a time and split with shifts.
+template <typename T, int bits>
+void histogram_c(const uint8_t* srcp, const int src_pitch, const int width, const int height, uint32_t* hist) noexcept
+{
+    constexpr int bins{ 1 << std::min(bits, 12) };
+    constexpr int shift{ (bits > 12 && bits < 32) ? bits - 12 : 0 };
+    constexpr int ways{ histogram_ways(bits) };
 
-    const size_t src_pitch{ src->GetPitch() / sizeof(T) };
-    const size_t dst_pitch{ dst->GetPitch() / sizeof(T) };
-    const size_t width{ src->GetRowSize() / sizeof(T) };
-    const T* srcp{ reinterpret_cast<const T*>(src->GetReadPtr()) };
-    T* __restrict dstp{ reinterpret_cast<T*>(dst->GetWritePtr()) };
+    const auto bin{ [](const T v) noexcept
+        {
+            if constexpr (std::is_same_v<T, uint8_t>)
+                return static_cast<int>(v);
+            else if constexpr (std::is_same_v<T, uint16_t>)
+                return std::min(v >> shift, bins - 1);
+            else
+                return static_cast<int>(std::clamp(v, 0.0f, 1.0f) * (bins - 1) + 0.5f);
+        } };
 
-    const float avg{ average_plane_c<T, peak>(srcp, src_pitch, width, height) };
-    const float temp{ avg * avg * luma_scaling };
+    uint32_t(*sub)[bins]{ reinterpret_cast<uint32_t(*)[bins]>(hist) };
+    const T* s{ reinterpret_cast<const T*>(srcp) };
+    const int pitch{ src_pitch / static_cast<int>(sizeof(T)) };
+    const int mod_width{ width & ~(ways - 1) };
 
     for (int y{ 0 }; y < height; ++y)
     {
-        for (size_t x{ 0 }; x < width; ++x)
+        for (int x{ 0 }; x < mod_width; x += ways)
         {
-            if constexpr (std::is_integral_v<T>)
+            if constexpr (bits == 8)
             {
-                if constexpr (fade)
+                uint64_t v;
+                memcpy(&v, s + x, sizeof(v));
+
+                ++sub[0][v & 255];
+                ++sub[1][(v >> 8) & 255];
+                ++sub[2][(v >> 16) & 255];
+                ++sub[3][(v >> 24) & 255];
+                ++sub[4][(v >> 32) & 255];
+                ++sub[5][(v >> 40) & 255];
+                ++sub[6][(v >> 48) & 255];
+                ++sub[7][v >> 56];
+            }
+            else
+            {
+                ++sub[0][bin(s[x])];
+                ++sub[1][bin(s[x + 1])];
+                ++sub[2][bin(s[x + 2])];
+                ++sub[3][bin(s[x + 3])];
+            }
+        }
+
+        for (int x{ mod_width }; x < width; ++x)
+            ++sub[0][bin(s[x])];
+
+        s += pitch;
+    }
+}
+
+// Adds up the sub-histograms of every strip into one histogram for statistic().
+static std::vector<uint32_t> merge_histograms(const std::vector<std::vector<uint32_t>>& hists, const int bits)
+{
+    const size_t bins{ static_cast<size_t>(1) << std::min(bits, 12) };
+    std::vector<uint32_t> hist(bins);
+
+    for (const auto& h : hists)
+    {
+        for (size_t i{ 0 }; i < h.size(); ++i)
+            hist[i & (bins - 1)] += h[i];
+    }
+
+    return hist;
+}
+
+template <typename T, int peak>
+void build_table_c(void* table, const float* lut, const float temp) noexcept
+{
+    T* __restrict tablep{ reinterpret_cast<T*>(table) };
+
+    for (int i{ 0 }; i <= peak; ++i)
+        tablep[i] = std::clamp(static_cast<int>(std::pow(lut[i], temp) * peak + 0.5f), 0, peak);
+}
+
+template <typename T>
+void map_c(uint8_t* dstp_, const int dst_pitch_, const uint8_t* srcp_, const int src_pitch_, const int width, const int height, const void* table, const float temp, const bool nt) noexcept
+{
+    const size_t src_pitch{ src_pitch_ / sizeof(T) };
+    const size_t dst_pitch{ dst_pitch_ / sizeof(T) };
+    const T* srcp{ reinterpret_cast<const T*>(srcp_) };
+    T* dstp{ reinterpret_cast<T*>(dstp_) };
+    const T* tablep{ reinterpret_cast<const T*>(table) };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < width; ++x)
+            dstp[x] = tablep[srcp[x]];
+
+        srcp += src_pitch;
+        dstp += dst_pitch;
+    }
+}
+
+template <bool fade>
+void map_float_c(uint8_t* dstp_, const int dst_pitch_, const uint8_t* srcp_, const int src_pitch_, const int width, const int height, const void* table, const float temp, const bool nt) noexcept
+{
+    const size_t src_pitch{ src_pitch_ / sizeof(float) };
+    const size_t dst_pitch{ dst_pitch_ / sizeof(float) };
+    const float* srcp{ reinterpret_cast<const float*>(srcp_) };
+    float* dstp{ reinterpret_cast<float*>(dstp_) };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < width; ++x)
+        {
+            if constexpr (fade)
+            {
+                if (srcp[x] == 0.0f)
                 {
-                    if (srcp[x] <= ymin)
-                        continue;
-                    else if (srcp[x] <= y1)
-                    {
-                        dstp[x] = d0;
-                        continue;
-                    }
-                    else if (srcp[x] <= y2)
-                    {
-                        dstp[x] = d1;
-                        continue;
-                    }
-                    else if (srcp[x] >= ymax)
+                    dstp[x] = srcp[x];
+                    continue;
+                }
+                else if (srcp[x] == 1.0f)
+                {
+                    dstp[x] = 0.0f;
+                    continue;
+                }
+            }
+
+            dstp[x] = std::clamp(std::pow(1.0f - (srcp[x] * ((srcp[x] * ((srcp[x] * ((srcp[x] * ((srcp[x] * 18.188f) - 45.47f)) + 36.624f)) - 9.466f)) + 1.124f)), temp), 0.0f, 1.0f);
+        }
+
+        srcp += src_pitch;
+        dstp += dst_pitch;
+    }
+}
+
+// Linear interpolation in the float table; out-of-range (and NaN) pixels are computed directly.
+template <bool fade>
+void map_float_lut_c(uint8_t* dstp_, const int dst_pitch_, const uint8_t* srcp_, const int src_pitch_, const int width, const int height, const void* table, const float temp, const bool nt) noexcept
+{
+    const int entries{ *reinterpret_cast<const int*>(table) };
+
+    if (!entries)
+    {
+        map_float_c<fade>(dstp_, dst_pitch_, srcp_, src_pitch_, width, height, table, temp, nt);
+        return;
+    }
+
+    const size_t src_pitch{ src_pitch_ / sizeof(float) };
+    const size_t dst_pitch{ dst_pitch_ / sizeof(float) };
+    const float* srcp{ reinterpret_cast<const float*>(srcp_) };
+    float* dstp{ reinterpret_cast<float*>(dstp_) };
+    const float* tablep{ reinterpret_cast<const float*>(table) + 1 };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < width; ++x)
+        {
+            if constexpr (fade)
+            {
+                if (srcp[x] == 0.0f)
+                {
+                    dstp[x] = srcp[x];
+                    continue;
+                }
+                else if (srcp[x] == 1.0f)
+                {
+                    dstp[x] = 0.0f;
+                    continue;
+                }
+            }
+
+            if (srcp[x] >= 0.0f && srcp[x] <= 1.0f)
+            {
+                const float pos{ srcp[x] * entries };
+                const int i{ std::min(static_cast<int>(pos), entries - 1) };
+                dstp[x] = tablep[i] + (pos - i) * (tablep[i + 1] - tablep[i]);
+            }
+            else
+                dstp[x] = std::clamp(std::pow(1.0f - (srcp[x] * ((srcp[x] * ((srcp[x] * ((srcp[x] * ((srcp[x] * 18.188f) - 45.47f)) + 36.624f)) - 9.466f)) + 1.124f)), temp), 0.0f, 1.0f);
+        }
+
+        srcp += src_pitch;
+        dstp += dst_pitch;
+    }
+}
+
+template <typename T, int peak>
+void merge_row_c(uint8_t* dstp_, const uint8_t* cleanp_, const uint8_t* grainp_, const uint8_t* maskp_, const int width) noexcept
+{
+    T* dstp{ reinterpret_cast<T*>(dstp_) };
+    const T* cleanp{ reinterpret_cast<const T*>(cleanp_) };
+    const T* grainp{ reinterpret_cast<const T*>(grainp_) };
+    const T* maskp{ reinterpret_cast<const T*>(maskp_) };
+
+    for (int x{ 0 }; x < width; ++x)
+    {
+        if constexpr (std::is_same_v<T, float>)
+            dstp[x] = cleanp[x] + (grainp[x] - cleanp[x]) * maskp[x];
+        else
+            dstp[x] = static_cast<T>((static_cast<uint32_t>(cleanp[x]) * (peak - maskp[x]) + static_cast<uint32_t>(grainp[x]) * maskp[x] + peak / 2) / peak);
+    }
+}
+
+template <typename T, int peak>
+void grain_row_c(uint8_t* dstp_, const uint8_t* srcp_, const uint8_t* maskp_, const int width, const uint32_t key, const float scale) noexcept
+{
+    T* dstp{ reinterpret_cast<T*>(dstp_) };
+    const T* srcp{ reinterpret_cast<const T*>(srcp_) };
+    const T* maskp{ reinterpret_cast<const T*>(maskp_) };
+
+    for (int x{ 0 }; x < width; ++x)
+    {
+        const float v{ static_cast<float>(static_cast<int32_t>(noise_sample(noise_hash(key + x)))) * maskp[x] * scale + srcp[x] };
+
+        if constexpr (std::is_same_v<T, float>)
+            dstp[x] = v;
+        else
+            dstp[x] = static_cast<T>(std::clamp(v, 0.0f, static_cast<float>(peak)) + 0.5f);
+    }
+}
+
+using merge_func = void (*)(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+
+template <typename T, int peak>
+merge_func merge_kernel(const int isa) noexcept
+{
+    switch (isa)
+    {
+        case 3: return merge_row_avx512<T, peak>;
+        case 2: return merge_row_avx2<T, peak>;
+        case 1: return merge_row_sse2<T, peak>;
+        default: return merge_row_c<T, peak>;
+    }
+}
+
+using grain_func = void (*)(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+
+template <typename T, int peak>
+grain_func grain_kernel(const int isa) noexcept
+{
+    switch (isa)
+    {
+        case 3: return grain_row_avx512<T, peak>;
+        case 2: return grain_row_avx2<T, peak>;
+        case 1: return grain_row_sse2<T, peak>;
+        default: return grain_row_c<T, peak>;
+    }
+}
+
+// The instruction set picked for opt (validated by adaptive_mask): 0: C, 1: SSE2, 2: AVX2, 3: AVX512.
+static int kernel_isa(const int opt, IScriptEnvironment* env) noexcept
+{
+    const int flags{ env->GetCPUFlags() };
+
+    if (((flags & CPUF_AVX512F) && opt < 0) || opt == 3)
+        return 3;
+    if (((flags & CPUF_AVX2) && opt < 0) || opt == 2)
+        return 2;
+    if (((flags & CPUF_SSE2) && opt < 0) || opt == 1)
+        return 1;
+
+    return 0;
+}
+
+// The greyscale format the mask is returned in.
+static int luma_type(const int bits) noexcept
+{
+    switch (bits)
+    {
+        case 8: return VideoInfo::CS_Y8;
+        case 10: return VideoInfo::CS_Y10;
+        case 12: return VideoInfo::CS_Y12;
+        case 14: return VideoInfo::CS_Y14;
+        case 16: return VideoInfo::CS_Y16;
+        default: return VideoInfo::CS_Y32;
+    }
+}
+
+// Picks every (1 << ssw)-th mask value for a subsampled chroma row: the mask of the co-sited (left) luma sample.
+template <typename T>
+void subsample_row(uint8_t* dstp_, const uint8_t* srcp_, const int width, const int ssw) noexcept
+{
+    T* dstp{ reinterpret_cast<T*>(dstp_) };
+    const T* srcp{ reinterpret_cast<const T*>(srcp_) };
+
+    for (int x{ 0 }; x < width; ++x)
+        dstp[x] = srcp[x << ssw];
+}
+
+using map_func = void (*)(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+
+// Gathers are slow on some CPUs (AMD before Zen 3, Intel with the GDS microcode mitigation),
+// so both lookups are timed once per process and the faster one is used.
+template <typename T, map_func gather_map>
+bool gather_is_faster()
+{
+    static const bool faster{ []
+        {
+            constexpr int width{ 1024 };
+            constexpr int height{ 64 };
+            std::vector<T> src(width * height);
+            std::vector<T> dst(width * height);
+            std::vector<uint8_t> table((std::numeric_limits<T>::max() + 1) * sizeof(T) + sizeof(int));
+
+            uint32_t seed{ 1 };
+            for (auto& v : src)
+            {
+                seed = seed * 1664525 + 1013904223;
+                v = static_cast<T>(seed >> 16);
+            }
+
+            const auto time{ [&](const map_func func)
+                {
+                    auto best{ std::chrono::steady_clock::duration::max() };
+
+                    for (int i{ 0 }; i < 5; ++i)
                     {
-                        dstp[x] = 0;
-                        continue;
+                        const auto start{ std::chrono::steady_clock::now() };
+                        func(reinterpret_cast<uint8_t*>(dst.data()), width * sizeof(T), reinterpret_cast<const uint8_t*>(src.data()), width * sizeof(T), width, height, table.data(), 0.0f, false);
+                        best = std::min(best, std::chrono::steady_clock::now() - start);
                     }
+
+                    return best;
+                } };
+
+            return time(gather_map) < time(map_c<T>);
+        }() };
+
+    return faster;
+}
+
+template <typename T, map_func gather_map>
+map_func lookup_kernel(const int gather)
+{
+    return (gather == 1 || (gather == -1 && gather_is_faster<T, gather_map>())) ? gather_map : map_c<T>;
+}
+
+// The fade thresholds (16/17/18/235 and the 85/170 steps for 8-bit) are folded into the output table.
+template <typename T>
+void adaptive_mask::fade_table(T* tablep) const noexcept
+{
+    const int shift{ vi.BitsPerComponent() - 8 };
+    const int peak{ (1 << vi.BitsPerComponent()) - 1 };
+    const int ymin{ 16 << shift };
+    const int y1{ 17 << shift };
+    const int y2{ 18 << shift };
+    const int ymax{ 235 << shift };
+
+    for (int i{ 0 }; i <= ymin; ++i)
+        tablep[i] = i;
+    for (int i{ ymin + 1 }; i <= y1; ++i)
+        tablep[i] = 85 << shift;
+    for (int i{ y1 + 1 }; i <= y2; ++i)
+        tablep[i] = 170 << shift;
+    for (int i{ ymax }; i <= peak; ++i)
+        tablep[i] = 0;
+}
+
+static void cpuid(int regs[4], const unsigned leaf, const unsigned subleaf) noexcept
+{
+#ifdef _MSC_VER
+    __cpuidex(regs, leaf, subleaf);
+#else
+    unsigned r[4];
+    __cpuid_count(leaf, subleaf, r[0], r[1], r[2], r[3]);
+    std::memcpy(regs, r, sizeof(r));
+#endif
+}
+
+// Share of the last-level cache per logical CPU that uses it, from the deterministic cache parameters (leaf 4 on Intel, 0x8000001D on AMD).
+// 0 if unknown.
+static size_t llc_share() noexcept
+{
+    for (const unsigned leaf : { 0x4u, 0x8000001Du })
+    {
+        int regs[4];
+        cpuid(regs, leaf & 0x80000000u, 0);
+        if (static_cast<unsigned>(regs[0]) < leaf)
+            continue;
+
+        int level{ 0 };
+        size_t share{ 0 };
+
+        for (unsigned i{ 0 }; i < 16; ++i)
+        {
+            cpuid(regs, leaf, i);
+
+            const int type{ regs[0] & 31 };
+            if (type == 0)
+                break;
+
+            // Data or unified caches only.
+            if ((type == 1 || type == 3) && ((regs[0] >> 5) & 7) >= level)
+            {
+                const size_t ways{ ((static_cast<unsigned>(regs[1]) >> 22) & 1023) + 1u };
+                const size_t partitions{ ((static_cast<unsigned>(regs[1]) >> 12) & 1023) + 1u };
+                const size_t line{ (static_cast<unsigned>(regs[1]) & 4095) + 1u };
+                const size_t sets{ static_cast<unsigned>(regs[2]) + 1u };
+                const size_t sharing{ ((static_cast<unsigned>(regs[0]) >> 14) & 4095) + 1u };
+                level = (regs[0] >> 5) & 7;
+                share = ways * partitions * line * sets / sharing;
+            }
+        }
+
+        if (share)
+            return share;
+    }
+
+    return 0;
+}
+
+// Float table (lut_error > 0): the entry count followed by entries + 1 samples of the curve over [0, 1].
+// 4096 entries are tried first, then 16384; the interpolation error is measured against the curve at the middle of every interval.
+// A count of 0 means neither size is within lut_error and the frame is computed without the table.
+std::shared_ptr<std::vector<uint8_t>> adaptive_mask::float_table(const float temp) const
+{
+    for (const int entries : { 4096, 16384 })
+    {
+        // Both rows start 64-byte aligned so the vector loads and stores of float_curve don't split cache lines.
+        const int count{ 2 * entries + 1 };
+        const int row{ (count + 15) & ~15 };
+        std::vector<float> buffer(2 * row + 16);
+        float* x{ reinterpret_cast<float*>((reinterpret_cast<uintptr_t>(buffer.data()) + 63) & ~static_cast<uintptr_t>(63)) };
+        float* y{ x + row };
+
+        for (int i{ 0 }; i < count; ++i)
+            x[i] = static_cast<float>(i) / (count - 1);
+
+        float_curve(reinterpret_cast<uint8_t*>(y), row * sizeof(float), reinterpret_cast<const uint8_t*>(x), row * sizeof(float), count, 1, nullptr, temp, false);
+
+        float error{ 0.0f };
+        for (int i{ 1 }; i < count; i += 2)
+            error = std::max(error, std::abs((y[i - 1] + y[i + 1]) * 0.5f - y[i]));
+
+        if (error <= lut_error)
+        {
+            auto data{ std::make_shared<std::vector<uint8_t>>(sizeof(int) + (static_cast<size_t>(entries) + 1) * sizeof(float)) };
+            std::memcpy(data->data(), &entries, sizeof(int));
+
+            float* tablep{ reinterpret_cast<float*>(data->data()) + 1 };
+            for (int i{ 0 }; i <= entries; ++i)
+                tablep[i] = y[2 * i];
+
+            return data;
+        }
+    }
+
+    return std::make_shared<std::vector<uint8_t>>(sizeof(int));
+}
+
+// Returns the output table for avg, building it only when it is not cached.
+// With cache_levels > 0 avg is snapped to the key so the table doesn't depend on which frame built it.
+// Tables are shared, so a frame still mapping with an evicted table keeps it alive.
+std::shared_ptr<const std::vector<uint8_t>> adaptive_mask::get_table(float& avg)
+{
+    uint32_t key;
+
+    if (cache_levels)
+    {
+        // Out-of-range averages (float clips) would otherwise wrap the key; NaN is treated as 0.
+        key = static_cast<uint32_t>(std::clamp(std::isnan(avg) ? 0.0f : avg, 0.0f, 1.0f) * cache_levels + 0.5f);
+        avg = static_cast<float>(key) / cache_levels;
+    }
+    else
+        std::memcpy(&key, &avg, sizeof(key));
+
+    auto find{ [&]() -> std::shared_ptr<const std::vector<uint8_t>>
+        {
+            for (auto it{ tables.begin() }; it != tables.end(); ++it)
+            {
+                if (it->key == key)
+                {
+                    tables.splice(tables.begin(), tables, it);
+                    return tables.front().data;
                 }
+            }
+
+            return nullptr;
+        } };
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+
+        if (auto data{ find() })
+        {
+            ++cache_hits;
+            return data;
+        }
+
+        ++cache_misses;
+    }
+
+    std::shared_ptr<std::vector<uint8_t>> data;
+
+    if (vi.ComponentSize() < 4)
+    {
+        // The gather kernels read up to three bytes past the last entry.
+        data = std::make_shared<std::vector<uint8_t>>((static_cast<size_t>(1) << vi.BitsPerComponent()) * vi.ComponentSize() + sizeof(int));
+        build_table(data->data(), lut, avg * avg * luma_scaling);
+
+        if (fade)
+        {
+            if (vi.ComponentSize() == 1)
+                fade_table(data->data());
+            else
+                fade_table(reinterpret_cast<uint16_t*>(data->data()));
+        }
+    }
+    else
+        data = float_table(avg * avg * luma_scaling);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    // Another frame may have built the same table meanwhile.
+    if (auto cached{ find() })
+        return cached;
+
+    if (tables.size() >= std::max<size_t>(cache_size, 1))
+        tables.pop_back();
+
+    tables.push_front({ key, data });
+
+    return data;
+}
+
+int adaptive_mask::strips(const int height) const noexcept
+{
+    return (pool) ? std::min(pool->size(), height) : 1;
+}
+
+// Calls func(strip, first_row, end_row) for every row strip, in parallel when threads > 1.
+template <typename F>
+void adaptive_mask::for_each_strip(const int height, F&& func)
+{
+    const int count{ strips(height) };
+
+    if (count == 1)
+        func(0, 0, height);
+    else
+        pool->run(count, [&](int i) { func(i, height * i / count, height * (i + 1) / count); });
+}
+
+float adaptive_mask::to_average(const double total, const int width, const int height) const noexcept
+{
+    return (vi.ComponentSize() < 4) ? (static_cast<float>(total) / (height * width)) / ((1 << vi.BitsPerComponent()) - 1) : static_cast<float>(total) / (height * width);
+}
+
+// With minmax, the smallest and largest samples are merged into minmax[0..1].
+double adaptive_mask::sum_rows(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) const noexcept
+{
+    if (!minmax)
+        return sum(srcp, src_pitch, width, height);
+
+    float range[2];
+    const double total{ sum_range(srcp, src_pitch, width, height, range) };
+    minmax[0] = std::min(minmax[0], range[0]);
+    minmax[1] = std::max(minmax[1], range[1]);
+
+    return total;
+}
+
+// Sums the rows of [y0, y1) that are inside a. srcp points at the first row of the frame.
+double adaptive_mask::sum_area(const uint8_t* srcp, const int src_pitch, const area& a, const int y0, const int y1, float* minmax) const noexcept
+{
+    const int top{ std::max(y0, a.top) };
+    const int bottom{ std::min(y1, a.bottom) };
+    if (top >= bottom)
+        return 0.0;
+
+    return sum_rows(srcp + static_cast<int64_t>(top) * src_pitch + static_cast<int64_t>(a.left) * vi.ComponentSize(), src_pitch, a.right - a.left, bottom - top, minmax);
+}
+
+// Sums the rows in the same blocks as the lagged sweep, so float averages don't depend on which path computed them.
+double adaptive_mask::sum_blocks(const uint8_t* srcp, const int src_pitch, const area& a, const int y0, const int y1, float* minmax) const noexcept
+{
+    if (lag <= 0.0f)
+        return sum_area(srcp, src_pitch, a, y0, y1, minmax);
+
+    double total{ 0.0 };
+    for (int y{ y0 }; y < y1; y += block_rows)
+        total += sum_area(srcp, src_pitch, a, y, std::min(y + block_rows, y1), minmax);
+
+    return total;
+}
+
+// A row is part of a bar when its brightest sample is at most 10% of the range.
+bool adaptive_mask::black_row(const uint8_t* srcp, const int width) const noexcept
+{
+    float minmax[2]{ std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest() };
+    sum_range(srcp, 0, width, 1, minmax);
+
+    return to_average(minmax[1], 1, 1) <= 0.1f;
+}
+
+// Black rows at the top and bottom, up to a third of the height each.
+adaptive_mask::area adaptive_mask::find_bars(const PVideoFrame& frame) const noexcept
+{
+    const int height{ frame->GetHeight() };
+    const int width{ frame->GetRowSize() / vi.ComponentSize() };
+    const int pitch{ frame->GetPitch() };
+    const uint8_t* srcp{ frame->GetReadPtr() };
+
+    int top{ 0 };
+    while (top < height / 3 && black_row(srcp + static_cast<int64_t>(top) * pitch, width))
+        ++top;
+
+    int bottom{ height };
+    while (bottom > height - height / 3 && black_row(srcp + static_cast<int64_t>(bottom - 1) * pitch, width))
+        --bottom;
+
+    return { 0, top, width, bottom };
+}
+
+// The bars are found again in every frame from that frame only, so the averaged area (and the average) doesn't depend on which
+// frames were requested before; only the bar rows and the first picture row are read.
+adaptive_mask::area adaptive_mask::stat_area(const PVideoFrame& frame) const noexcept
+{
+    if (!crop_auto)
+        return { crop.left, crop.top, frame->GetRowSize() / vi.ComponentSize() - crop.right, frame->GetHeight() - crop.bottom };
+
+    return find_bars(frame);
+}
+
+// The percentile of a histogram from merge_histograms(), as a sample value scaled to [0, 1]. 14/16-bit bins give the middle of their range.
+// minmax receives the smallest and largest values the first and last used bins can hold.
+float adaptive_mask::statistic(const std::vector<uint32_t>& hist, float* minmax) const noexcept
+{
+    const int bins{ static_cast<int>(hist.size()) };
+    const int shift{ (vi.ComponentSize() == 2) ? vi.BitsPerComponent() - std::min(vi.BitsPerComponent(), 12) : 0 };
+    const auto raw{ [&](const int b, const int offset) { return (vi.ComponentSize() < 4) ? static_cast<float>((b << shift) + offset) : static_cast<float>(b) / (bins - 1); } };
+
+    int64_t count{ 0 };
+    for (const uint32_t h : hist)
+        count += h;
+
+    const int64_t rank{ std::max<int64_t>(static_cast<int64_t>(std::ceil(percentile / 100.0 * count)), 1) };
+    int64_t cum{ 0 };
+    int b{ 0 };
+    for (; b < bins - 1; ++b)
+    {
+        cum += hist[b];
+        if (cum >= rank)
+            break;
+    }
+
+    if (minmax)
+    {
+        int first{ 0 };
+        while (first < bins - 1 && !hist[first])
+            ++first;
+        int last{ bins - 1 };
+        while (last > 0 && !hist[last])
+            --last;
+
+        minmax[0] = std::min(minmax[0], raw(first, 0));
+        minmax[1] = std::max(minmax[1], raw(last, (1 << shift) - 1));
+    }
+
+    return (vi.ComponentSize() < 4) ? (raw(b, 0) + ((1 << shift) - 1) * 0.5f) / ((1 << vi.BitsPerComponent()) - 1) : raw(b, 0);
+}
+
+// With avg_sample > 1 only every avg_sample-th row is read. bound receives the half width of an approximate 95% confidence
+// interval of the estimate, from the spread of the sampled row averages (0 when every row is read).
+// minmax receives the smallest and largest samples of the rows that were read.
+float adaptive_mask::frame_average(const PVideoFrame& frame, float* bound, float* minmax)
+{
+    const int pitch{ frame->GetPitch() };
+    const area a{ stat_area(frame) };
+    // The averaged part of the frame; rows outside it aren't read.
+    const int height{ a.bottom - a.top };
+    const int width{ a.right - a.left };
+    const uint8_t* srcp{ frame->GetReadPtr() + static_cast<int64_t>(a.top) * pitch + static_cast<int64_t>(a.left) * vi.ComponentSize() };
+
+    std::vector<std::array<float, 2>> ranges(strips(frame->GetHeight()), { std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest() });
+    float avg;
+
+    if (percentile >= 0.0f)
+    {
+        // One histogram per strip over the rows that are read.
+        const int rows{ (height + avg_sample - 1) / avg_sample };
+        const int64_t step{ static_cast<int64_t>(pitch) * avg_sample };
+
+        // avg_sample <= height keeps step within the frame buffer, whose size is an int, so it fits the kernel's pitch.
+        std::vector<std::vector<uint32_t>> hists(strips(rows), std::vector<uint32_t>(histogram_size(vi.BitsPerComponent())));
+        for_each_strip(rows, [&](int i, int y0, int y1) { histogram(srcp + y0 * step, static_cast<int>(step), width, y1 - y0, hists[i].data()); });
+
+        if (bound)
+            *bound = 0.0f;
+
+        return statistic(merge_histograms(hists, vi.BitsPerComponent()), minmax);
+    }
+
+    if (avg_sample > 1)
+    {
+        const int rows{ (height + avg_sample - 1) / avg_sample };
+        const int64_t step{ static_cast<int64_t>(pitch) * avg_sample };
+
+        std::vector<double> row_sums(rows);
+        for_each_strip(rows, [&](int i, int y0, int y1)
+            {
+                for (int y{ y0 }; y < y1; ++y)
+                    row_sums[y] = sum_rows(srcp + y * step, pitch, width, 1, (minmax) ? ranges[i].data() : nullptr);
+            });
+
+        double total{ 0.0 };
+        for (const double s : row_sums)
+            total += s;
+
+        avg = to_average(total, width, rows);
+
+        if (bound)
+        {
+            double var{ 0.0 };
+            for (const double s : row_sums)
+            {
+                const double d{ to_average(s, width, 1) - avg };
+                var += d * d;
+            }
+
+            // Sample variance of the row averages with the finite population correction.
+            *bound = (rows > 1) ? static_cast<float>(1.96 * std::sqrt(var / (rows - 1) / rows * (1.0 - static_cast<double>(rows) / height))) : 1.0f;
+        }
+    }
+    else
+    {
+        // Strips and blocks are laid over the whole frame, as in the lagged sweep.
+        const int frame_height{ frame->GetHeight() };
+        std::vector<double> sums(strips(frame_height));
+        for_each_strip(frame_height, [&](int i, int y0, int y1) { sums[i] = sum_blocks(frame->GetReadPtr(), pitch, a, y0, y1, (minmax) ? ranges[i].data() : nullptr); });
+
+        double total{ 0.0 };
+        for (const double s : sums)
+            total += s;
+
+        if (bound)
+            *bound = 0.0f;
+
+        avg = to_average(total, width, height);
+    }
+
+    if (minmax)
+    {
+        for (const auto& r : ranges)
+        {
+            minmax[0] = std::min(minmax[0], r[0]);
+            minmax[1] = std::max(minmax[1], r[1]);
+        }
+    }
+
+    return avg;
+}
+
+bool adaptive_mask::prop_average(const PVideoFrame& frame, float& avg, IScriptEnvironment* env) const
+{
+    if (!v8 || avg_prop.empty())
+        return false;
+
+    int err;
+    const double value{ env->propGetFloat(env->getFramePropsRO(frame), avg_prop.c_str(), 0, &err) };
+    // NaN or infinite values are ignored: get_table can't quantise them.
+    if (err || !std::isfinite(value))
+        return false;
+
+    avg = static_cast<float>(std::clamp(value, 0.0, 1.0));
+    return true;
+}
+
+// With props = 2, range (raw minimum and maximum, NaN when unknown) comes with a stored average. An average stored without it (by a
+// run with props < 2) has it measured now, unless the frame has avg_prop: then the average is taken from there and has no range.
+bool adaptive_mask::known_average(const int n, const PVideoFrame& frame, float& avg, float* range, IScriptEnvironment* env)
+{
+    if (find_average(n, avg, range) || (stats && stats->get(n, avg, range)))
+    {
+        if (range && std::isnan(range[0]) && !prop_average(frame, avg, env))
+        {
+            range[0] = std::numeric_limits<float>::max();
+            range[1] = std::numeric_limits<float>::lowest();
+            frame_average(frame, nullptr, range);
+
+            store_average(n, avg, range);
+            if (stats)
+                stats->set(n, avg, range);
+        }
+
+        return true;
+    }
+
+    return prop_average(frame, avg, env);
+}
+
+// The average of frame n for lag and tr. Frame n is read only when its average isn't stored anywhere.
+float adaptive_mask::average_at(const int n, IScriptEnvironment* env)
+{
+    float avg;
+    if (find_average(n, avg) || (stats && stats->get(n, avg)))
+        return avg;
+
+    // With props = 2 the range is measured in the same pass, so the frame isn't read again when it is output.
+    float range[2]{ std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest() };
+    const PVideoFrame frame{ child->GetFrame(n, env) };
+    if (prop_average(frame, avg, env))
+        store_average(n, avg);
+    else
+    {
+        avg = frame_average(frame, nullptr, (props == 2) ? range : nullptr);
+        store_average(n, avg, (props == 2) ? range : nullptr);
+        if (stats)
+            stats->set(n, avg, (props == 2) ? range : nullptr);
+    }
+
+    return avg;
+}
+
+// The mean of the averages of frames n - tr..n + tr (repeating the first and last frame at the ends).
+// Stepping to the next frame replaces one term of the running total; any other access sums the whole window.
+float adaptive_mask::smoothed_average(const int n, IScriptEnvironment* env)
+{
+    const auto fixed{ [&](const int k) { return static_cast<int64_t>(std::llround(static_cast<double>(average_at(std::clamp(k, 0, vi.num_frames - 1), env)) * 1099511627776.0)); } };
+
+    int center;
+    int64_t total;
+    {
+        std::lock_guard<std::mutex> lock(window_mutex);
+        center = window_center;
+        total = window_total;
+    }
+
+    if (center == n - 1)
+        total += fixed(n + tr) - fixed(n - 1 - tr);
+    else if (center != n)
+    {
+        total = 0;
+        for (int k{ n - tr }; k <= n + tr; ++k)
+            total += fixed(k);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(window_mutex);
+        window_center = n;
+        window_total = total;
+    }
 
-                dstp[x] = std::clamp(static_cast<int>(std::pow(lut[srcp[x]], temp) * peak + 0.5f), 0, peak);
-            }
-            else
-            {
-                if constexpr (fade)
-                {
-                    if (srcp[x] == 0.0f)
-                        continue;
-                    else if (srcp[x] == 1.0f)
-                    {
-                        dstp[x] = 0.0f;
-                        continue;
-                    }
-                }
+    return static_cast<float>(static_cast<double>(total) / 1099511627776.0 / (2 * tr + 1));
+}
 
-                dstp[x] = std::clamp(std::pow(1.0f - (srcp[x] * ((srcp[x] * ((srcp[x] * ((srcp[x] * ((srcp[x] * 18.188f) - 45.47f)) + 36.624f)) - 9.466f)) + 1.124f)), temp), 0.0f, 1.0f);
-            }
-        }
+bool adaptive_mask::find_average(const int n, float& avg, float* range)
+{
+    std::lock_guard<std::mutex> lock(average_mutex);
 
-        srcp += src_pitch;
-        dstp += dst_pitch;
+    const auto& entry{ averages[n % averages.size()] };
+    if (entry.n != n)
+        return false;
+
+    avg = entry.avg;
+    if (range)
+    {
+        range[0] = entry.range[0];
+        range[1] = entry.range[1];
     }
+
+    return true;
+}
+
+void adaptive_mask::store_average(const int n, const float avg, const float* range)
+{
+    constexpr float nan{ std::numeric_limits<float>::quiet_NaN() };
+
+    std::lock_guard<std::mutex> lock(average_mutex);
+    averages[n % averages.size()] = { n, avg, { (range) ? range[0] : nan, (range) ? range[1] : nan } };
 }
 
-AGM::AGM(PClip child, float luma_scaling_, bool fade, int opt, IScriptEnvironment* env)
-    : GenericVideoFilter(child), luma_scaling(luma_scaling_), v8(true)
+adaptive_mask::adaptive_mask(PClip child_, const agm_options& o, IScriptEnvironment* env)
+    : child(child_), vi(child_->GetVideoInfo()), luma_scaling(o.luma_scaling), fade(o.fade), lut(nullptr), lut_error(o.lut_error), v8(true), lag(o.lag), block_rows(1), tr(o.tr),
+    window_center(std::numeric_limits<int>::min()), window_total(0), avg_sample(o.avg_sample), avg_prop(o.avg_prop), props(o.props), crop(), crop_auto(false), cache_size(o.cache),
+    cache_levels(o.cache_levels), cache_hits(0), cache_misses(0), build_table(nullptr), float_curve(nullptr)
 {
     if (!vi.IsPlanar())
-        env->ThrowError("AGM: only planar input is supported!");
+        env->ThrowError("%s: only planar input is supported!", o.name);
     if (vi.IsRGB())
-        env->ThrowError("AGM: only YUV input is supported!");
-    if (opt < -1 || opt > 3)
-        env->ThrowError("AGM: opt must be between - 1..3.");
+        env->ThrowError("%s: only YUV input is supported!", o.name);
+    if (luma_scaling < 0.0f)
+        env->ThrowError("%s: luma_scaling must be greater than or equal to 0.0.", o.name);
+    if (o.cache < 0)
+        env->ThrowError("%s: cache must be greater than or equal to 0.", o.name);
+    if (cache_levels < 0)
+        env->ThrowError("%s: cache_levels must be greater than or equal to 0.", o.name);
+    if (o.threads < 0)
+        env->ThrowError("%s: threads must be greater than or equal to 0.", o.name);
+    if (o.gather < -1 || o.gather > 1)
+        env->ThrowError("%s: gather must be between -1..1.", o.name);
+
+    const bool fast{ !strcmp(o.precision, "fast") };
+    if (!fast && strcmp(o.precision, "exact"))
+        env->ThrowError("%s: precision must be \"fast\" or \"exact\".", o.name);
+    if (lut_error < 0.0f)
+        env->ThrowError("%s: lut_error must be greater than or equal to 0.0.", o.name);
+    if (lag < 0.0f)
+        env->ThrowError("%s: lag must be greater than or equal to 0.0.", o.name);
+    if (avg_sample < 1)
+        env->ThrowError("%s: avg_sample must be greater than or equal to 1.", o.name);
+    if (avg_sample > vi.height)
+        env->ThrowError("%s: avg_sample must be less than or equal to the clip height.", o.name);
+    if (lag > 0.0f && avg_sample > 1)
+        env->ThrowError("%s: lag and avg_sample can't be used together.", o.name);
+    if (props < 0 || props > 2)
+        env->ThrowError("%s: props must be between 0..2.", o.name);
+    if (tr < 0)
+        env->ThrowError("%s: tr must be greater than or equal to 0.", o.name);
+    if (lag > 0.0f && tr > 0)
+        env->ThrowError("%s: lag and tr can't be used together.", o.name);
+
+    percentile = -1.0f;
+    if (!strcmp(o.stat, "median"))
+        percentile = 50.0f;
+    else if (o.stat[0] == 'p')
+    {
+        char* end;
+        percentile = strtof(o.stat + 1, &end);
+        if (end == o.stat + 1 || *end || percentile < 0.0f || percentile > 100.0f)
+            env->ThrowError("%s: stat must be \"mean\", \"median\" or \"pNN\" (0 <= NN <= 100).", o.name);
+    }
+    else if (strcmp(o.stat, "mean"))
+        env->ThrowError("%s: stat must be \"mean\", \"median\" or \"pNN\" (0 <= NN <= 100).", o.name);
+
+    if (!strcmp(o.stat_crop, "auto"))
+        crop_auto = true;
+    else if (*o.stat_crop)
+    {
+        int end{ 0 };
+        if (sscanf(o.stat_crop, "%d,%d,%d,%d%n", &crop.left, &crop.top, &crop.right, &crop.bottom, &end) != 4 || o.stat_crop[end])
+            env->ThrowError("%s: stat_crop must be \"auto\" or \"left,top,right,bottom\".", o.name);
+        if (crop.left < 0 || crop.top < 0 || crop.right < 0 || crop.bottom < 0 || crop.left + crop.right >= vi.width || crop.top + crop.bottom >= vi.height)
+            env->ThrowError("%s: stat_crop margins must be greater than or equal to 0 and leave part of the frame.", o.name);
+    }
+
+    if (o.opt < -1 || o.opt > 3)
+        env->ThrowError("%s: opt must be between - 1..3.", o.name);
 
     const bool avx512{ !!(env->GetCPUFlags() & CPUF_AVX512F) };
     const bool avx2{ !!(env->GetCPUFlags() & CPUF_AVX2) };
     const bool sse2{ !!(env->GetCPUFlags() & CPUF_SSE2) };
 
-    if (!avx512 && opt == 3)
-        env->ThrowError("AGM: opt=3 requires AVX512F.");
-    if (!avx2 && opt == 2)
-        env->ThrowError("AGM: opt=2 requires AVX2.");
-    if (!sse2 && opt == 1)
-        env->ThrowError("AGM: opt=1 requires SSE2.");
+    if (!avx512 && o.opt == 3)
+        env->ThrowError("%s: opt=3 requires AVX512F.", o.name);
+    if (!avx2 && o.opt == 2)
+        env->ThrowError("%s: opt=2 requires AVX2.", o.name);
+    if (!sse2 && o.opt == 1)
+        env->ThrowError("%s: opt=1 requires SSE2.", o.name);
 
-    if ((avx512 && opt < 0) || opt == 3)
+    if ((avx512 && o.opt < 0) || o.opt == 3)
     {
         switch (vi.BitsPerComponent())
         {
             case 8:
             {
-                process = (fade) ? process_avx512<uint8_t, true, 255, 16, 17, 18, 235, 85, 170> : process_avx512<uint8_t, false, 255, 16, 17, 18, 235, 85, 170>;
-                vi.pixel_type = VideoInfo::CS_Y8;
+                sum = sum_avx512<uint8_t, 255>;
+                sum_range = sum_range_avx512<uint8_t, 255>;
+                build_table = build_table_avx512<uint8_t, 255>;
+                map = (env->GetCPUFlags() & CPUF_AVX512VBMI) ? map_shuffle_avx512vbmi : map_shuffle_avx512;
                 break;
             }
             case 10:
             {
-                process = (fade) ? process_avx512<uint16_t, true, 1023, 64, 68, 72, 940, 340, 680> : process_avx512<uint16_t, false, 1023, 64, 68, 72, 940, 340, 680>;
-                vi.pixel_type = VideoInfo::CS_Y10;
+                sum = sum_avx512<uint16_t, 1023>;
+                sum_range = sum_range_avx512<uint16_t, 1023>;
+                build_table = build_table_avx512<uint16_t, 1023>;
+                map = lookup_kernel<uint16_t, map_avx512<uint16_t>>(o.gather);
                 break;
             }
             case 12:
             {
-                process = (fade) ? process_avx512<uint16_t, true, 4095, 256, 272, 288, 3760, 1360, 2720> : process_avx512<uint16_t, false, 4095, 256, 272, 288, 3760, 1360, 2720>;
-                vi.pixel_type = VideoInfo::CS_Y12;
+                sum = sum_avx512<uint16_t, 4095>;
+                sum_range = sum_range_avx512<uint16_t, 4095>;
+                build_table = build_table_avx512<uint16_t, 4095>;
+                map = lookup_kernel<uint16_t, map_avx512<uint16_t>>(o.gather);
                 break;
             }
             case 14:
             {
-                process = (fade) ? process_avx512<uint16_t, true, 16383, 1024, 1088, 1152, 15040, 5440, 10880> : process_avx512<uint16_t, false, 16383, 1024, 1088, 1152, 15040, 5440, 10880>;
-                vi.pixel_type = VideoInfo::CS_Y14;
+                sum = sum_avx512<uint16_t, 16383>;
+                sum_range = sum_range_avx512<uint16_t, 16383>;
+                build_table = build_table_avx512<uint16_t, 16383>;
+                map = lookup_kernel<uint16_t, map_avx512<uint16_t>>(o.gather);
                 break;
             }
             case 16:
             {
-                process = (fade) ? process_avx512<uint16_t, true, 65535, 4096, 4352, 4608, 60160, 21760, 43520> : process_avx512<uint16_t, false, 65535, 4096, 4352, 4608, 60160, 21760, 43520>;
-                vi.pixel_type = VideoInfo::CS_Y16;
+                sum = sum_avx512<uint16_t, 65535>;
+                sum_range = sum_range_avx512<uint16_t, 65535>;
+                build_table = build_table_avx512<uint16_t, 65535>;
+                map = lookup_kernel<uint16_t, map_avx512<uint16_t>>(o.gather);
                 break;
             }
             default:
             {
-                process = (fade) ? process_avx512<float, true, 0, 0, 0, 0, 0, 0, 0> : process_avx512<float, false, 0, 0, 0, 0, 0, 0, 0>;
-                vi.pixel_type = VideoInfo::CS_Y32;
+                sum = sum_avx512<float, 0>;
+                sum_range = sum_range_avx512<float, 0>;
+                if (fast)
+                {
+                    float_curve = map_float_avx512<false, true>;
+
+                    if (lut_error > 0.0f)
+                        map = (fade) ? map_float_lut_avx512<true, true> : map_float_lut_avx512<false, true>;
+                    else
+                        map = (fade) ? map_float_avx512<true, true> : map_float_avx512<false, true>;
+                }
+                else
+                {
+                    float_curve = map_float_avx512<false, false>;
+
+                    if (lut_error > 0.0f)
+                        map = (fade) ? map_float_lut_avx512<true, false> : map_float_lut_avx512<false, false>;
+                    else
+                        map = (fade) ? map_float_avx512<true, false> : map_float_avx512<false, false>;
+                }
                 break;
             }
         }
     }
-    else if ((avx2 && opt < 0) || opt == 2)
+    else if ((avx2 && o.opt < 0) || o.opt == 2)
     {
         switch (vi.BitsPerComponent())
         {
             case 8:
             {
-                process = (fade) ? process_avx2<uint8_t, true, 255, 16, 17, 18, 235, 85, 170> : process_avx2<uint8_t, false, 255, 16, 17, 18, 235, 85, 170>;
-                vi.pixel_type = VideoInfo::CS_Y8;
+                sum = sum_avx2<uint8_t, 255>;
+                sum_range = sum_range_avx2<uint8_t, 255>;
+                build_table = build_table_avx2<uint8_t, 255>;
+                map = map_shuffle_avx2;
                 break;
             }
             case 10:
             {
-                process = (fade) ? process_avx2<uint16_t, true, 1023, 64, 68, 72, 940, 340, 680> : process_avx2<uint16_t, false, 1023, 64, 68, 72, 940, 340, 680>;
-                vi.pixel_type = VideoInfo::CS_Y10;
+                sum = sum_avx2<uint16_t, 1023>;
+                sum_range = sum_range_avx2<uint16_t, 1023>;
+                build_table = build_table_avx2<uint16_t, 1023>;
+                map = lookup_kernel<uint16_t, map_avx2<uint16_t>>(o.gather);
                 break;
             }
             case 12:
             {
-                process = (fade) ? process_avx2<uint16_t, true, 4095, 256, 272, 288, 3760, 1360, 2720> : process_avx2<uint16_t, false, 4095, 256, 272, 288, 3760, 1360, 2720>;
-                vi.pixel_type = VideoInfo::CS_Y12;
+                sum = sum_avx2<uint16_t, 4095>;
+                sum_range = sum_range_avx2<uint16_t, 4095>;
+                build_table = build_table_avx2<uint16_t, 4095>;
+                map = lookup_kernel<uint16_t, map_avx2<uint16_t>>(o.gather);
                 break;
             }
             case 14:
             {
-                process = (fade) ? process_avx2<uint16_t, true, 16383, 1024, 1088, 1152, 15040, 5440, 10880> : process_avx2<uint16_t, false, 16383, 1024, 1088, 1152, 15040, 5440, 10880>;
-                vi.pixel_type = VideoInfo::CS_Y14;
+                sum = sum_avx2<uint16_t, 16383>;
+                sum_range = sum_range_avx2<uint16_t, 16383>;
+                build_table = build_table_avx2<uint16_t, 16383>;
+                map = lookup_kernel<uint16_t, map_avx2<uint16_t>>(o.gather);
                 break;
             }
             case 16:
             {
-                process = (fade) ? process_avx2<uint16_t, true, 65535, 4096, 4352, 4608, 60160, 21760, 43520> : process_avx2<uint16_t, false, 65535, 4096, 4352, 4608, 60160, 21760, 43520>;
-                vi.pixel_type = VideoInfo::CS_Y16;
+                sum = sum_avx2<uint16_t, 65535>;
+                sum_range = sum_range_avx2<uint16_t, 65535>;
+                build_table = build_table_avx2<uint16_t, 65535>;
+                map = lookup_kernel<uint16_t, map_avx2<uint16_t>>(o.gather);
                 break;
             }
             default:
             {
-                process = (fade) ? process_avx2<float, true, 0, 0, 0, 0, 0, 0, 0> : process_avx2<float, false, 0, 0, 0, 0, 0, 0, 0>;
-                vi.pixel_type = VideoInfo::CS_Y32;
+                sum = sum_avx2<float, 0>;
+                sum_range = sum_range_avx2<float, 0>;
+                if (fast)
+                {
+                    float_curve = map_float_avx2<false, true>;
+
+                    if (lut_error > 0.0f)
+                        map = (fade) ? map_float_lut_avx2<true, true> : map_float_lut_avx2<false, true>;
+                    else
+                        map = (fade) ? map_float_avx2<true, true> : map_float_avx2<false, true>;
+                }
+                else
+                {
+                    float_curve = map_float_avx2<false, false>;
+
+                    if (lut_error > 0.0f)
+                        map = (fade) ? map_float_lut_avx2<true, false> : map_float_lut_avx2<false, false>;
+                    else
+                        map = (fade) ? map_float_avx2<true, false> : map_float_avx2<false, false>;
+                }
                 break;
             }
         }
     }
-    else if ((sse2 && opt < 0) || opt == 1)
+    else if ((sse2 && o.opt < 0) || o.opt == 1)
     {
         switch (vi.BitsPerComponent())
         {
             case 8:
             {
-                process = (fade) ? process_sse2<uint8_t, true, 255, 16, 17, 18, 235, 85, 170> : process_sse2<uint8_t, false, 255, 16, 17, 18, 235, 85, 170>;
-                vi.pixel_type = VideoInfo::CS_Y8;
+                sum = sum_sse2<uint8_t, 255>;
+                sum_range = sum_range_sse2<uint8_t, 255>;
+                build_table = build_table_sse2<uint8_t, 255>;
+                map = map_c<uint8_t>;
                 break;
             }
             case 10:
             {
-                process = (fade) ? process_sse2<uint16_t, true, 1023, 64, 68, 72, 940, 340, 680> : process_sse2<uint16_t, false, 1023, 64, 68, 72, 940, 340, 680>;
-                vi.pixel_type = VideoInfo::CS_Y10;
+                sum = sum_sse2<uint16_t, 1023>;
+                sum_range = sum_range_sse2<uint16_t, 1023>;
+                build_table = build_table_sse2<uint16_t, 1023>;
+                map = map_c<uint16_t>;
                 break;
             }
             case 12:
             {
-                process = (fade) ? process_sse2<uint16_t, true, 4095, 256, 272, 288, 3760, 1360, 2720> : process_sse2<uint16_t, false, 4095, 256, 272, 288, 3760, 1360, 2720>;
-                vi.pixel_type = VideoInfo::CS_Y12;
+                sum = sum_sse2<uint16_t, 4095>;
+                sum_range = sum_range_sse2<uint16_t, 4095>;
+                build_table = build_table_sse2<uint16_t, 4095>;
+                map = map_c<uint16_t>;
                 break;
             }
             case 14:
             {
-                process = (fade) ? process_sse2<uint16_t, true, 16383, 1024, 1088, 1152, 15040, 5440, 10880> : process_sse2<uint16_t, false, 16383, 1024, 1088, 1152, 15040, 5440, 10880>;
-                vi.pixel_type = VideoInfo::CS_Y14;
+                sum = sum_sse2<uint16_t, 16383>;
+                sum_range = sum_range_sse2<uint16_t, 16383>;
+                build_table = build_table_sse2<uint16_t, 16383>;
+                map = map_c<uint16_t>;
                 break;
             }
             case 16:
             {
-                process = (fade) ? process_sse2<uint16_t, true, 65535, 4096, 4352, 4608, 60160, 21760, 43520> : process_sse2<uint16_t, false, 65535, 4096, 4352, 4608, 60160, 21760, 43520>;
-                vi.pixel_type = VideoInfo::CS_Y16;
+                sum = sum_sse2<uint16_t, 65535>;
+                sum_range = sum_range_sse2<uint16_t, 65535>;
+                build_table = build_table_sse2<uint16_t, 65535>;
+                map = map_c<uint16_t>;
                 break;
             }
             default:
             {
-                process = (fade) ? process_sse2<float, true, 0, 0, 0, 0, 0, 0, 0> : process_sse2<float, false, 0, 0, 0, 0, 0, 0, 0>;
-                vi.pixel_type = VideoInfo::CS_Y32;
+                sum = sum_sse2<float, 0>;
+                sum_range = sum_range_sse2<float, 0>;
+                if (fast)
+                {
+                    float_curve = map_float_sse2<false, true>;
+
+                    if (lut_error > 0.0f)
+                        map = (fade) ? map_float_lut_sse2<true, true> : map_float_lut_sse2<false, true>;
+                    else
+                        map = (fade) ? map_float_sse2<true, true> : map_float_sse2<false, true>;
+                }
+                else
+                {
+                    float_curve = map_float_sse2<false, false>;
+
+                    if (lut_error > 0.0f)
+                        map = (fade) ? map_float_lut_sse2<true, false> : map_float_lut_sse2<false, false>;
+                    else
+                        map = (fade) ? map_float_sse2<true, false> : map_float_sse2<false, false>;
+                }
                 break;
             }
         }
@@ -243,75 +1275,701 @@ AGM::AGM(PClip child, float luma_scaling_, bool fade, int opt, IScriptEnvironmen
         {
             case 8:
             {
-                process = (fade) ? process_c<uint8_t, true, 255, 16, 17, 18, 235, 85, 170> : process_c<uint8_t, false, 255, 16, 17, 18, 235, 85, 170>;
-                vi.pixel_type = VideoInfo::CS_Y8;
+                sum = sum_c<uint8_t, 255>;
+                sum_range = sum_range_c<uint8_t, 255>;
+                build_table = build_table_c<uint8_t, 255>;
+                map = map_c<uint8_t>;
                 break;
             }
             case 10:
             {
-                process = (fade) ? process_c<uint16_t, true, 1023, 64, 68, 72, 940, 340, 680> : process_c<uint16_t, false, 1023, 64, 68, 72, 940, 340, 680>;
-                vi.pixel_type = VideoInfo::CS_Y10;
+                sum = sum_c<uint16_t, 1023>;
+                sum_range = sum_range_c<uint16_t, 1023>;
+                build_table = build_table_c<uint16_t, 1023>;
+                map = map_c<uint16_t>;
                 break;
             }
             case 12:
             {
-                process = (fade) ? process_c<uint16_t, true, 4095, 256, 272, 288, 3760, 1360, 2720> : process_c<uint16_t, false, 4095, 256, 272, 288, 3760, 1360, 2720>;
-                vi.pixel_type = VideoInfo::CS_Y12;
+                sum = sum_c<uint16_t, 4095>;
+                sum_range = sum_range_c<uint16_t, 4095>;
+                build_table = build_table_c<uint16_t, 4095>;
+                map = map_c<uint16_t>;
                 break;
             }
             case 14:
             {
-                process = (fade) ? process_c<uint16_t, true, 16383, 1024, 1088, 1152, 15040, 5440, 10880> : process_c<uint16_t, false, 16383, 1024, 1088, 1152, 15040, 5440, 10880>;
-                vi.pixel_type = VideoInfo::CS_Y14;
+                sum = sum_c<uint16_t, 16383>;
+                sum_range = sum_range_c<uint16_t, 16383>;
+                build_table = build_table_c<uint16_t, 16383>;
+                map = map_c<uint16_t>;
                 break;
             }
             case 16:
             {
-                process = (fade) ? process_c<uint16_t, true, 65535, 4096, 4352, 4608, 60160, 21760, 43520> : process_c<uint16_t, false, 65535, 4096, 4352, 4608, 60160, 21760, 43520>;
-                vi.pixel_type = VideoInfo::CS_Y16;
+                sum = sum_c<uint16_t, 65535>;
+                sum_range = sum_range_c<uint16_t, 65535>;
+                build_table = build_table_c<uint16_t, 65535>;
+                map = map_c<uint16_t>;
                 break;
             }
             default:
             {
-                process = (fade) ? process_c<float, true, 0, 0, 0, 0, 0, 0, 0> : process_c<float, false, 0, 0, 0, 0, 0, 0, 0>;
-                vi.pixel_type = VideoInfo::CS_Y32;
+                sum = sum_c<float, 0>;
+                sum_range = sum_range_c<float, 0>;
+                float_curve = map_float_c<false>;
+
+                if (lut_error > 0.0f)
+                    map = (fade) ? map_float_lut_c<true> : map_float_lut_c<false>;
+                else
+                    map = (fade) ? map_float_c<true> : map_float_c<false>;
                 break;
             }
         }
     }
 
-    if (vi.ComponentSize() < 4)
+    switch (vi.BitsPerComponent())
     {
-        const int range_max{ 1 << vi.BitsPerComponent() };
-        const float peak{ static_cast<float>(range_max - 1) };
-        lut.reserve(range_max);
-        for (int i{ 0 }; i < range_max; ++i)
-        {
-            const float x{ i / peak };
-            lut.emplace_back(1.0f - (x * ((x * ((x * ((x * ((x * 18.188f) - 45.47f)) + 36.624f)) - 9.466f)) + 1.124f)));
-        }
+        case 8: lut = shared_lut<8>(); break;
+        case 10: lut = shared_lut<10>(); break;
+        case 12: lut = shared_lut<12>(); break;
+        case 14: lut = shared_lut<14>(); break;
+        case 16: lut = shared_lut<16>(); break;
+    }
+
+    switch (vi.BitsPerComponent())
+    {
+        case 8: histogram = histogram_c<uint8_t, 8>; break;
+        case 10: histogram = histogram_c<uint16_t, 10>; break;
+        case 12: histogram = histogram_c<uint16_t, 12>; break;
+        case 14: histogram = histogram_c<uint16_t, 14>; break;
+        case 16: histogram = histogram_c<uint16_t, 16>; break;
+        default: histogram = histogram_c<float, 32>; break;
     }
 
+    const int threads{ (o.threads == 0) ? std::max(static_cast<int>(std::thread::hardware_concurrency()), 1) : o.threads };
+    if (threads > 1)
+        pool = std::make_unique<thread_pool>(threads);
+
+    // About 128 KiB of source rows: a block is summed and then mapped while it is still in L2.
+    block_rows = std::max(static_cast<int>((128 << 10) / (static_cast<size_t>(vi.width) * vi.ComponentSize())), 1);
+    // Room for the window and for the frames processed in parallel around it.
+    averages.assign(std::max(64, 4 * tr + 2), { -1, 0.0f, { 0.0f, 0.0f } });
+
     try { env->CheckVersion(8); }
     catch (const AvisynthError&) { v8 = false; }
+
+    if (*o.stats_file)
+    {
+        stats_file::header id{};
+        memcpy(id.magic, "AGMSTATS", sizeof(id.magic));
+        id.version = 2;
+        id.width = vi.width;
+        id.height = vi.height;
+        id.num_frames = vi.num_frames;
+        id.pixel_type = luma_type(vi.BitsPerComponent());
+        id.fps_numerator = vi.fps_numerator;
+        id.fps_denominator = vi.fps_denominator;
+        id.avg_sample = avg_sample;
+        id.stat = (percentile < 0.0f) ? 0 : static_cast<uint32_t>(std::lround(percentile * 1000.0f)) + 1;
+
+        // Sixteen rows of the first frame's luma are hashed, so another source with the same format isn't taken for the one the file was written for.
+        const PVideoFrame frame{ child->GetFrame(0, env) };
+        const int rows{ frame->GetHeight() };
+        const int row_size{ frame->GetRowSize() };
+        const uint8_t* srcp{ frame->GetReadPtr() };
+
+        uint64_t hash{ 14695981039346656037ULL };
+        for (int y{ 0 }; y < rows; y += std::max(rows / 16, 1))
+        {
+            for (int x{ 0 }; x < row_size; ++x)
+                hash = (hash ^ srcp[static_cast<int64_t>(y) * frame->GetPitch() + x]) * 1099511628211ULL;
+        }
+
+        // The averaged area is part of the identity too.
+        for (const char* c{ o.stat_crop }; *c; ++c)
+            hash = (hash ^ static_cast<uint8_t>(*c)) * 1099511628211ULL;
+
+        id.fingerprint = hash;
+
+        stats = std::make_unique<stats_file>();
+        switch (stats->open(o.stats_file, id))
+        {
+            case stats_file::status::ok: break;
+            case stats_file::status::mismatch: env->ThrowError("%s: stats_file was written for another clip or other settings; delete it or use another path.", o.name);
+            default: env->ThrowError("%s: cannot open stats_file.", o.name);
+        }
+    }
+}
+
+frame_stats adaptive_mask::measure(const int n, const PVideoFrame& src, IScriptEnvironment* env)
+{
+    frame_stats s{ 0.0f, 0.0f, 0.0f, { std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN() }, -1.0f };
+    float* const range_p{ (props == 2) ? s.range : nullptr };
+    const bool known{ known_average(n, src, s.avg, range_p, env) };
+
+    if (!known)
+    {
+        s.range[0] = std::numeric_limits<float>::max();
+        s.range[1] = std::numeric_limits<float>::lowest();
+        s.avg = frame_average(src, &s.bound, range_p);
+
+        if (stats)
+            stats->set(n, s.avg, range_p);
+    }
+
+    float mapped{ s.avg };
+    if (tr > 0)
+    {
+        store_average(n, s.avg, range_p);
+        mapped = smoothed_average(n, env);
+    }
+
+    s.temp = mapped * mapped * luma_scaling;
+    return s;
+}
+
+void adaptive_mask::map_block(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int rows, const void* table, const float temp, const bool nt, double* mask_sum) const noexcept
+{
+    map(dstp, dst_pitch, srcp, src_pitch, width, rows, table, temp, nt);
+
+    if (mask_sum)
+        *mask_sum += sum(dstp, dst_pitch, width, rows);
+}
+
+// The mask of every row is written to a one-row buffer that stays in L1 and blended (AGMMerge) or used to scale the generated grain
+// (AGMGrain) right away; the chroma rows use the mask of the luma row they are co-sited with, so no mask plane is stored.
+template <typename F>
+void adaptive_mask::mask_rows(const PVideoFrame& clean, const int y0, const int y1, const void* table, const float temp, double* mask_sum, const bool chroma, F&& blend) const
+{
+    const int size{ vi.ComponentSize() };
+    const int width{ clean->GetRowSize() / size };
+    const bool uv{ chroma && !vi.IsY() };
+    const int ssw{ (uv) ? vi.GetPlaneWidthSubsampling(PLANAR_U) : 0 };
+    const int ssh{ (uv) ? vi.GetPlaneHeightSubsampling(PLANAR_U) : 0 };
+
+    // Padded so the vector loads of the map kernels stay in bounds; the second half holds the subsampled chroma mask.
+    std::vector<uint8_t> buffer(static_cast<size_t>(width) * size * 2 + 128);
+    uint8_t* maskp{ buffer.data() };
+    uint8_t* mask_uv{ (ssw) ? buffer.data() + static_cast<size_t>(width) * size + 64 : maskp };
+
+    const uint8_t* srcp{ clean->GetReadPtr() };
+    const int src_pitch{ clean->GetPitch() };
+    const int chroma_width{ (uv) ? clean->GetRowSize(PLANAR_U) / size : 0 };
+
+    for (int y{ y0 }; y < y1; ++y)
+    {
+        map_block(maskp, 0, srcp + static_cast<int64_t>(y) * src_pitch, 0, width, 1, table, temp, false, mask_sum);
+        blend(0, y, maskp, width);
+
+        if (uv && !(y & ((1 << ssh) - 1)))
+        {
+            const int cy{ y >> ssh };
+
+            if (ssw)
+            {
+                switch (size)
+                {
+                    case 1: subsample_row<uint8_t>(mask_uv, maskp, chroma_width, ssw); break;
+                    case 2: subsample_row<uint16_t>(mask_uv, maskp, chroma_width, ssw); break;
+                    default: subsample_row<float>(mask_uv, maskp, chroma_width, ssw); break;
+                }
+            }
+
+            blend(1, cy, mask_uv, chroma_width);
+            blend(2, cy, mask_uv, chroma_width);
+        }
+    }
+}
+
+template <typename F>
+frame_stats adaptive_mask::process(const int n, const PVideoFrame& src, F&& map_rows, IScriptEnvironment* env)
+{
+    const int height{ src->GetHeight() };
+    const int width{ src->GetRowSize() / vi.ComponentSize() };
+    const int src_pitch{ src->GetPitch() };
+    const uint8_t* srcp{ src->GetReadPtr() };
+
+    const int count{ strips(height) };
+    std::vector<double> mask_sums(count);
+    std::vector<std::array<float, 2>> ranges(count, { std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest() });
+
+    const auto map_frame{ [&](float avg)
+        {
+            const auto table{ (build_table || lut_error > 0.0f) ? get_table(avg) : nullptr };
+            const uint8_t* tablep{ (table) ? table->data() : nullptr };
+            const float temp{ avg * avg * luma_scaling };
+
+            for_each_strip(height, [&](int i, int y0, int y1)
+                {
+                    mask_sums[i] = 0.0;
+
+                    // With props = 2 the mask is summed block by block while it is in cache.
+                    if (props == 2)
+                    {
+                        for (int y{ y0 }; y < y1; y += block_rows)
+                            map_rows(y, std::min(block_rows, y1 - y), tablep, temp, &mask_sums[i]);
+                    }
+                    else
+                        map_rows(y0, y1 - y0, tablep, temp, nullptr);
+                });
+
+            return temp;
+        } };
+
+    float bound{ 0.0f };
+    float range[2]{ std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN() };
+    float* const range_p{ (props == 2) ? range : nullptr };
+    float avg;
+    float temp;
+    const bool known{ known_average(n, src, avg, range_p, env) };
+
+    if (known)
+    {
+        // The lagged choice is repeated so the frame is mapped the same way as when its average was measured.
+        float mapped{ avg };
+        if (tr > 0)
+        {
+            store_average(n, avg, range_p);
+            mapped = smoothed_average(n, env);
+        }
+        else if (lag > 0.0f && n > 0)
+        {
+            const float prev{ average_at(n - 1, env) };
+            if (std::fabs(avg - prev) <= lag)
+                mapped = prev;
+        }
+
+        temp = map_frame(mapped);
+    }
+    else if (lag > 0.0f && n > 0)
+    {
+        // Frame n is mapped with the average of frame n - 1 while its own rows are summed in the same sweep.
+        // The output must not depend on the access order, so a previous average that isn't stored yet (random access, or frames
+        // requested out of order by MT) is measured from frame n - 1: lag only saves bandwidth when frames are requested in order.
+        const float prev{ average_at(n - 1, env) };
+
+        float lagged{ prev };
+        const auto table{ (build_table || lut_error > 0.0f) ? get_table(lagged) : nullptr };
+        const uint8_t* tablep{ (table) ? table->data() : nullptr };
+        temp = lagged * lagged * luma_scaling;
+
+        // Only the rows of the averaged area are summed; every row is mapped.
+        const area a{ stat_area(src) };
+
+        std::vector<double> sums(count);
+        // The histograms are zeroed once here and every block of the strip adds to them.
+        std::vector<std::vector<uint32_t>> hists((percentile >= 0.0f) ? count : 0, std::vector<uint32_t>(histogram_size(vi.BitsPerComponent())));
+        for_each_strip(height, [&](int i, int y0, int y1)
+            {
+                double total{ 0.0 };
+                for (int y{ y0 }; y < y1; y += block_rows)
+                {
+                    const int rows{ std::min(block_rows, y1 - y) };
+
+                    if (percentile >= 0.0f)
+                    {
+                        const int top{ std::max(y, a.top) };
+                        const int bottom{ std::min(y + rows, a.bottom) };
+
+                        if (top < bottom)
+                            histogram(srcp + static_cast<int64_t>(top) * src_pitch + static_cast<int64_t>(a.left) * vi.ComponentSize(), src_pitch, a.right - a.left, bottom - top, hists[i].data());
+                    }
+                    else
+                        total += sum_area(srcp, src_pitch, a, y, y + rows, (props == 2) ? ranges[i].data() : nullptr);
+
+                    map_rows(y, rows, tablep, temp, (props == 2) ? &mask_sums[i] : nullptr);
+                }
+
+                sums[i] = total;
+            });
+
+        if (percentile >= 0.0f)
+            avg = statistic(merge_histograms(hists, vi.BitsPerComponent()), (props == 2) ? ranges[0].data() : nullptr);
+        else
+        {
+            double total{ 0.0 };
+            for (const double s : sums)
+                total += s;
+
+            avg = to_average(total, a.right - a.left, a.bottom - a.top);
+        }
+
+        // Scene change: the frame is mapped again with its own average.
+        if (std::fabs(avg - prev) > lag)
+            temp = map_frame(avg);
+    }
+    else
+    {
+        avg = frame_average(src, &bound, (props == 2) ? ranges[0].data() : nullptr);
+
+        if (tr > 0)
+        {
+            store_average(n, avg, (props == 2) ? ranges[0].data() : nullptr);
+            temp = map_frame(smoothed_average(n, env));
+        }
+        else
+            temp = map_frame(avg);
+    }
+
+    if (!known)
+    {
+        range[0] = std::numeric_limits<float>::max();
+        range[1] = std::numeric_limits<float>::lowest();
+        for (const auto& r : ranges)
+        {
+            range[0] = std::min(range[0], r[0]);
+            range[1] = std::max(range[1], r[1]);
+        }
+    }
+
+    if (lag > 0.0f || tr > 0)
+        store_average(n, avg, range_p);
+    if (stats && !known)
+        stats->set(n, avg, range_p);
+
+    frame_stats s{ avg, temp, bound, { range[0], range[1] }, -1.0f };
+    if (props == 2)
+    {
+        double mask_total{ 0.0 };
+        for (const double part : mask_sums)
+            mask_total += part;
+
+        s.mask_avg = to_average(mask_total, width, height);
+    }
+
+    return s;
+}
+
+void adaptive_mask::set_props(PVideoFrame& frame, const frame_stats& s, IScriptEnvironment* env) const
+{
+    if (!v8)
+        return;
+
+    AVSMap* props_map{ env->getFramePropsRW(frame) };
+
+    if (cache_size)
+    {
+        env->propSetInt(props_map, "AGM_CacheHits", cache_hits, 0);
+        env->propSetInt(props_map, "AGM_CacheMisses", cache_misses, 0);
+    }
+
+    if (avg_sample > 1)
+        env->propSetFloat(props_map, "AGM_AverageBound", s.bound, 0);
+
+    if (props)
+    {
+        env->propSetFloat(props_map, "AGM_Average", s.avg, 0);
+        env->propSetFloat(props_map, "AGM_Exponent", s.temp, 0);
+    }
+
+    if (props == 2)
+    {
+        // Only an average taken from avg_prop has no range.
+        if (!std::isnan(s.range[0]))
+        {
+            env->propSetFloat(props_map, "AGM_Min", to_average(s.range[0], 1, 1), 0);
+            env->propSetFloat(props_map, "AGM_Max", to_average(s.range[1], 1, 1), 0);
+        }
+
+        if (s.mask_avg >= 0.0f)
+            env->propSetFloat(props_map, "AGM_MaskAverage", s.mask_avg, 0);
+    }
+}
+
+AGM::AGM(PClip child, const agm_options& o, int nt, IScriptEnvironment* env)
+    : GenericVideoFilter(child), mask(child, o, env), stream(nt), in_place(vi.IsY() && o.lag <= 0.0f)
+{
+    if (nt < -1 || nt > 1)
+        env->ThrowError("AGM: nt must be between -1..1.");
+
+    // The output plane is read by the next filter right after it is written, so it is kept in cache while it fits in this thread's share
+    // of the last-level cache (other frames are processed in parallel with frame-level threading). Unknown cache: regular stores.
+    if (stream == -1)
+    {
+        const size_t share{ llc_share() };
+        stream = (share && static_cast<size_t>(vi.width) * vi.height * vi.ComponentSize() > share) ? 1 : 0;
+    }
+
+    vi.pixel_type = luma_type(vi.BitsPerComponent());
 }
 
 PVideoFrame __stdcall AGM::GetFrame(int n, IScriptEnvironment* env)
 {
     PVideoFrame src{ child->GetFrame(n, env) };
-    PVideoFrame dst{ (v8) ? env->NewVideoFrameP(vi, &src) : env->NewVideoFrame(vi) };
+    // A greyscale frame that nothing else references is overwritten; the average is taken before any pixel is mapped.
+    // The frame is moved, not copied: a second handle would make it unwritable and GetWritePtr would return nullptr.
+    const bool overwrite{ in_place && src->IsWritable() };
+    PVideoFrame dst{ (overwrite) ? std::move(src) : (mask.has_frame_props()) ? env->NewVideoFrameP(vi, &src) : env->NewVideoFrame(vi) };
+    const PVideoFrame& input{ (overwrite) ? dst : src };
+
+    const int width{ input->GetRowSize() / vi.ComponentSize() };
+    const int src_pitch{ input->GetPitch() };
+    const int dst_pitch{ dst->GetPitch() };
+    const uint8_t* srcp{ input->GetReadPtr() };
+    uint8_t* dstp{ dst->GetWritePtr() };
+
+    // Streaming stores need aligned rows; the C kernels ignore nt. The mask average reads every block back right after it is written.
+    const bool nt{ stream == 1 && !mask.mask_average() && !(reinterpret_cast<uintptr_t>(dstp) & 63) && !(dst_pitch & 63) };
+
+    const frame_stats s{ mask.process(n, input, [&](const int y, const int rows, const void* table, const float temp, double* mask_sum)
+        {
+            mask.map_block(dstp + static_cast<int64_t>(y) * dst_pitch, dst_pitch, srcp + static_cast<int64_t>(y) * src_pitch, src_pitch, width, rows, table, temp, nt, mask_sum);
+
+            if (nt)
+                _mm_sfence();
+        }, env) };
+
+    mask.set_props(dst, s, env);
+    return dst;
+}
+
+AGMStats::AGMStats(PClip child, const agm_options& o, IScriptEnvironment* env)
+    : GenericVideoFilter(child), mask(child, o, env)
+{
+    if (o.props < 1 || o.props > 2)
+        env->ThrowError("AGMStats: props must be between 1..2.");
 
-    process(dst, src, luma_scaling, lut, env);
+    // GetFrame copies only the property map with MakePropertyWritable, which is part of interface version 9.
+    try { env->CheckVersion(9); }
+    catch (const AvisynthError&) { env->ThrowError("AGMStats: AviSynth+ 3.7.1 or later (interface version 9) is required."); }
+}
+
+PVideoFrame __stdcall AGMStats::GetFrame(int n, IScriptEnvironment* env)
+{
+    PVideoFrame frame{ child->GetFrame(n, env) };
+    const frame_stats s{ mask.measure(n, frame, env) };
+
+    // Only the property map is copied; the returned frame shares the source's pixel buffer.
+    env->MakePropertyWritable(&frame);
+    mask.set_props(frame, s, env);
+    return frame;
+}
+
+AGMMerge::AGMMerge(PClip clean, PClip grained, const agm_options& o, int chroma_, IScriptEnvironment* env)
+    : GenericVideoFilter(clean), mask(clean, o, env), grain(grained), chroma(chroma_)
+{
+    const VideoInfo& vi_grain{ grain->GetVideoInfo() };
+    if (!vi.IsSameColorspace(vi_grain) || vi.width != vi_grain.width || vi.height != vi_grain.height)
+        env->ThrowError("AGMMerge: clean and grained must have the same format and dimensions.");
+    if (chroma < 0 || chroma > 2)
+        env->ThrowError("AGMMerge: chroma must be between 0..2.");
+
+    const int isa{ kernel_isa(o.opt, env) };
+    switch (vi.BitsPerComponent())
+    {
+        case 8: merge_row = merge_kernel<uint8_t, 255>(isa); break;
+        case 10: merge_row = merge_kernel<uint16_t, 1023>(isa); break;
+        case 12: merge_row = merge_kernel<uint16_t, 4095>(isa); break;
+        case 14: merge_row = merge_kernel<uint16_t, 16383>(isa); break;
+        case 16: merge_row = merge_kernel<uint16_t, 65535>(isa); break;
+        default: merge_row = merge_kernel<float, 0>(isa); break;
+    }
+}
+
+PVideoFrame __stdcall AGMMerge::GetFrame(int n, IScriptEnvironment* env)
+{
+    const PVideoFrame src{ child->GetFrame(n, env) };
+    const PVideoFrame grained{ grain->GetFrame(n, env) };
+    PVideoFrame dst{ (mask.has_frame_props()) ? env->NewVideoFrameP(vi, &src) : env->NewVideoFrame(vi) };
+
+    // The plane pointers are taken once; blend runs for every row.
+    constexpr int planes[3]{ PLANAR_Y, PLANAR_U, PLANAR_V };
+    uint8_t* dstp[3]{};
+    const uint8_t* srcp[3]{};
+    const uint8_t* grainp[3]{};
+    int dst_pitch[3]{};
+    int src_pitch[3]{};
+    int grain_pitch[3]{};
+    for (int p{ 0 }; p < ((vi.IsY()) ? 1 : 3); ++p)
+    {
+        dstp[p] = dst->GetWritePtr(planes[p]);
+        srcp[p] = src->GetReadPtr(planes[p]);
+        grainp[p] = grained->GetReadPtr(planes[p]);
+        dst_pitch[p] = dst->GetPitch(planes[p]);
+        src_pitch[p] = src->GetPitch(planes[p]);
+        grain_pitch[p] = grained->GetPitch(planes[p]);
+    }
+
+    const frame_stats s{ mask.process(n, src, [&](const int y, const int rows, const void* table, const float temp, double* mask_sum)
+        {
+            mask.mask_rows(src, y, y + rows, table, temp, mask_sum, chroma == 2, [&](const int p, const int row, const uint8_t* maskp, const int width)
+                {
+                    merge_row(dstp[p] + static_cast<int64_t>(row) * dst_pitch[p], srcp[p] + static_cast<int64_t>(row) * src_pitch[p], grainp[p] + static_cast<int64_t>(row) * grain_pitch[p], maskp, width);
+                });
+        }, env) };
+
+    if (!vi.IsY())
+    {
+        // With chroma = 2 the chroma planes were blended with the luma rows; alpha comes from clean.
+        for (const int plane : { PLANAR_U, PLANAR_V, PLANAR_A })
+        {
+            if ((plane == PLANAR_A) ? !vi.IsYUVA() : chroma == 2)
+                continue;
+
+            const PVideoFrame& from{ (plane != PLANAR_A && chroma == 1) ? grained : src };
+            env->BitBlt(dst->GetWritePtr(plane), dst->GetPitch(plane), from->GetReadPtr(plane), from->GetPitch(plane), from->GetRowSize(plane), from->GetHeight(plane));
+        }
+    }
+
+    mask.set_props(dst, s, env);
+    return dst;
+}
+
+AGMGrain::AGMGrain(PClip child, const agm_options& o, float var, float uvar, int seed_, bool constant_, IScriptEnvironment* env)
+    : GenericVideoFilter(child), mask(child, o, env), noise_scale(), seed(static_cast<uint32_t>(seed_)), constant(constant_), chroma(uvar > 0.0f)
+{
+    if (var < 0.0f)
+        env->ThrowError("AGMGrain: var must be greater than or equal to 0.0.");
+    if (uvar < 0.0f)
+        env->ThrowError("AGMGrain: uvar must be greater than or equal to 0.0.");
+
+    // var is the variance in 8-bit units: the standard deviation is sqrt(var) * peak / 255 and the mask is divided by peak (1.0 for 32-bit).
+    noise_scale[0] = std::sqrt(var) / (255.0f * noise_sd);
+    noise_scale[1] = std::sqrt(uvar) / (255.0f * noise_sd);
+
+    const int isa{ kernel_isa(o.opt, env) };
+    switch (vi.BitsPerComponent())
+    {
+        case 8: grain_row = grain_kernel<uint8_t, 255>(isa); break;
+        case 10: grain_row = grain_kernel<uint16_t, 1023>(isa); break;
+        case 12: grain_row = grain_kernel<uint16_t, 4095>(isa); break;
+        case 14: grain_row = grain_kernel<uint16_t, 16383>(isa); break;
+        case 16: grain_row = grain_kernel<uint16_t, 65535>(isa); break;
+        default: grain_row = grain_kernel<float, 0>(isa); break;
+    }
+}
+
+PVideoFrame __stdcall AGMGrain::GetFrame(int n, IScriptEnvironment* env)
+{
+    const PVideoFrame src{ child->GetFrame(n, env) };
+    PVideoFrame dst{ (mask.has_frame_props()) ? env->NewVideoFrameP(vi, &src) : env->NewVideoFrame(vi) };
+
+    // The plane pointers are taken once; blend runs for every row.
+    constexpr int planes[3]{ PLANAR_Y, PLANAR_U, PLANAR_V };
+    uint8_t* dstp[3]{};
+    const uint8_t* srcp[3]{};
+    int dst_pitch[3]{};
+    int src_pitch[3]{};
+    for (int p{ 0 }; p < ((vi.IsY()) ? 1 : 3); ++p)
+    {
+        dstp[p] = dst->GetWritePtr(planes[p]);
+        srcp[p] = src->GetReadPtr(planes[p]);
+        dst_pitch[p] = dst->GetPitch(planes[p]);
+        src_pitch[p] = src->GetPitch(planes[p]);
+    }
+
+    const frame_stats s{ mask.process(n, src, [&](const int y, const int rows, const void* table, const float temp, double* mask_sum)
+        {
+            mask.mask_rows(src, y, y + rows, table, temp, mask_sum, chroma, [&](const int p, const int row, const uint8_t* maskp, const int width)
+                {
+                    grain_row(dstp[p] + static_cast<int64_t>(row) * dst_pitch[p], srcp[p] + static_cast<int64_t>(row) * src_pitch[p], maskp, width,
+                        noise_key(seed, (constant) ? 0 : n, planes[p], row), noise_scale[p != 0]);
+                });
+        }, env) };
+
+    if (!vi.IsY())
+    {
+        // Without chroma grain the chroma planes are copied; alpha is always copied.
+        for (const int plane : { PLANAR_U, PLANAR_V, PLANAR_A })
+        {
+            if ((plane == PLANAR_A) ? !vi.IsYUVA() : chroma)
+                continue;
+
+            env->BitBlt(dst->GetWritePtr(plane), dst->GetPitch(plane), src->GetReadPtr(plane), src->GetPitch(plane), src->GetRowSize(plane), src->GetHeight(plane));
+        }
+    }
 
+    mask.set_props(dst, s, env);
     return dst;
 }
 
 AVSValue __cdecl Create_AGM(AVSValue args, void*, IScriptEnvironment* env)
 {
-    enum { CLIP, LUMA_SC, FADE, OPT };
+    enum { CLIP, LUMA_SC, FADE, OPT, CACHE, CACHE_LEVELS, THREADS, GATHER, PRECISION, LUT_ERROR, NT, LAG, AVG_SAMPLE, AVG_PROP, PROPS, STATS_FILE, TR, STAT, STAT_CROP };
+
+    agm_options o;
+    o.luma_scaling = args[LUMA_SC].AsFloatf(o.luma_scaling);
+    o.fade = args[FADE].AsBool(o.fade);
+    o.opt = args[OPT].AsInt(o.opt);
+    o.cache = args[CACHE].AsInt(o.cache);
+    o.cache_levels = args[CACHE_LEVELS].AsInt(o.cache_levels);
+    o.threads = args[THREADS].AsInt(o.threads);
+    o.gather = args[GATHER].AsInt(o.gather);
+    o.precision = args[PRECISION].AsString(o.precision);
+    o.lut_error = args[LUT_ERROR].AsFloatf(o.lut_error);
+    o.lag = args[LAG].AsFloatf(o.lag);
+    o.avg_sample = args[AVG_SAMPLE].AsInt(o.avg_sample);
+    o.avg_prop = args[AVG_PROP].AsString(o.avg_prop);
+    o.props = args[PROPS].AsInt(o.props);
+    o.stats_file = args[STATS_FILE].AsString(o.stats_file);
+    o.tr = args[TR].AsInt(o.tr);
+    o.stat = args[STAT].AsString(o.stat);
+    o.stat_crop = args[STAT_CROP].AsString(o.stat_crop);
+
+    return new AGM(args[CLIP].AsClip(), o, args[NT].AsInt(-1), env);
+}
+
+AVSValue __cdecl Create_AGMMerge(AVSValue args, void*, IScriptEnvironment* env)
+{
+    enum { CLEAN, GRAINED, LUMA_SC, FADE, CHROMA, THREADS, AVG_SAMPLE, AVG_PROP, PROPS, STATS_FILE, TR, STAT, STAT_CROP, OPT };
+
+    agm_options o;
+    o.name = "AGMMerge";
+    o.luma_scaling = args[LUMA_SC].AsFloatf(o.luma_scaling);
+    o.fade = args[FADE].AsBool(o.fade);
+    o.threads = args[THREADS].AsInt(o.threads);
+    o.avg_sample = args[AVG_SAMPLE].AsInt(o.avg_sample);
+    o.avg_prop = args[AVG_PROP].AsString(o.avg_prop);
+    o.props = args[PROPS].AsInt(o.props);
+    o.stats_file = args[STATS_FILE].AsString(o.stats_file);
+    o.tr = args[TR].AsInt(o.tr);
+    o.stat = args[STAT].AsString(o.stat);
+    o.stat_crop = args[STAT_CROP].AsString(o.stat_crop);
+    o.opt = args[OPT].AsInt(o.opt);
+
+    return new AGMMerge(args[CLEAN].AsClip(), args[GRAINED].AsClip(), o, args[CHROMA].AsInt(2), env);
+}
+
+AVSValue __cdecl Create_AGMGrain(AVSValue args, void*, IScriptEnvironment* env)
+{
+    enum { CLIP, LUMA_SC, FADE, VAR, UVAR, SEED, CONSTANT, THREADS, AVG_SAMPLE, AVG_PROP, PROPS, STATS_FILE, TR, STAT, STAT_CROP, OPT };
+
+    agm_options o;
+    o.name = "AGMGrain";
+    o.luma_scaling = args[LUMA_SC].AsFloatf(o.luma_scaling);
+    o.fade = args[FADE].AsBool(o.fade);
+    o.threads = args[THREADS].AsInt(o.threads);
+    o.avg_sample = args[AVG_SAMPLE].AsInt(o.avg_sample);
+    o.avg_prop = args[AVG_PROP].AsString(o.avg_prop);
+    o.props = args[PROPS].AsInt(o.props);
+    o.stats_file = args[STATS_FILE].AsString(o.stats_file);
+    o.tr = args[TR].AsInt(o.tr);
+    o.stat = args[STAT].AsString(o.stat);
+    o.stat_crop = args[STAT_CROP].AsString(o.stat_crop);
+    o.opt = args[OPT].AsInt(o.opt);
+
+    return new AGMGrain(args[CLIP].AsClip(), o, args[VAR].AsFloatf(0.25f), args[UVAR].AsFloatf(0.0f), args[SEED].AsInt(0), args[CONSTANT].AsBool(false), env);
+}
+
+AVSValue __cdecl Create_AGMStats(AVSValue args, void*, IScriptEnvironment* env)
+{
+    enum { CLIP, LUMA_SC, THREADS, AVG_SAMPLE, AVG_PROP, PROPS, STATS_FILE, TR, STAT, STAT_CROP, OPT };
 
-    return new AGM(args[CLIP].AsClip(), args[LUMA_SC].AsFloatf(10.0f), args[FADE].AsBool(true), args[OPT].AsInt(-1), env);
+    agm_options o;
+    o.name = "AGMStats";
+    o.luma_scaling = args[LUMA_SC].AsFloatf(o.luma_scaling);
+    o.threads = args[THREADS].AsInt(o.threads);
+    o.avg_sample = args[AVG_SAMPLE].AsInt(o.avg_sample);
+    o.avg_prop = args[AVG_PROP].AsString(o.avg_prop);
+    o.props = args[PROPS].AsInt(o.props);
+    o.stats_file = args[STATS_FILE].AsString(o.stats_file);
+    o.tr = args[TR].AsInt(o.tr);
+    o.stat = args[STAT].AsString(o.stat);
+    o.stat_crop = args[STAT_CROP].AsString(o.stat_crop);
+    o.opt = args[OPT].AsInt(o.opt);
 
+    return new AGMStats(args[CLIP].AsClip(), o, env);
 }
 
 const AVS_Linkage* AVS_linkage = nullptr;
@@ -320,6 +1978,9 @@ extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit3(IScri
 {
     AVS_linkage = vectors;
 
-    env->AddFunction("AGM", "c[luma_scaling]f[fade]b[opt]i", Create_AGM, 0);
+    env->AddFunction("AGM", "c[luma_scaling]f[fade]b[opt]i[cache]i[cache_levels]i[threads]i[gather]i[precision]s[lut_error]f[nt]i[lag]f[avg_sample]i[avg_prop]s[props]i[stats_file]s[tr]i[stat]s[stat_crop]s", Create_AGM, 0);
+    env->AddFunction("AGMStats", "c[luma_scaling]f[threads]i[avg_sample]i[avg_prop]s[props]i[stats_file]s[tr]i[stat]s[stat_crop]s[opt]i", Create_AGMStats, 0);
+    env->AddFunction("AGMMerge", "cc[luma_scaling]f[fade]b[chroma]i[threads]i[avg_sample]i[avg_prop]s[props]i[stats_file]s[tr]i[stat]s[stat_crop]s[opt]i", Create_AGMMerge, 0);
+    env->AddFunction("AGMGrain", "c[luma_scaling]f[fade]b[var]f[uvar]f[seed]i[constant]b[threads]i[avg_sample]i[avg_prop]s[props]i[stats_file]s[tr]i[stat]s[stat_crop]s[opt]i", Create_AGMGrain, 0);
     return "AGM";
 }
@@ -1,30 +1,305 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "avisynth.h"
+#include "stats_file.h"
+#include "thread_pool.h"
 
-class AGM : public GenericVideoFilter
+// The parameters shared by AGM, AGMStats, AGMMerge and AGMGrain. A filter sets the ones it exposes and leaves the rest at their defaults.
+struct agm_options
+{
+    // The filter name used in error messages.
+    const char* name{ "AGM" };
+    float luma_scaling{ 10.0f };
+    bool fade{ true };
+    int cache{ 0 };
+    int cache_levels{ 0 };
+    int threads{ 1 };
+    int gather{ -1 };
+    const char* precision{ "exact" };
+    float lut_error{ 0.0f };
+    float lag{ 0.0f };
+    int avg_sample{ 1 };
+    const char* avg_prop{ "" };
+    int props{ 1 };
+    const char* stats_file{ "" };
+    int tr{ 0 };
+    const char* stat{ "mean" };
+    const char* stat_crop{ "" };
+    int opt{ -1 };
+};
+
+// The statistics of one frame, attached as frame properties by adaptive_mask::set_props.
+struct frame_stats
 {
+    float avg;
+    // The exponent the frame is mapped with.
+    float temp;
+    // AGM_AverageBound (avg_sample > 1).
+    float bound;
+    // The raw minimum and maximum sample (props = 2); NaN when the average was taken from avg_prop.
+    float range[2];
+    // The average of the mask (props = 2); negative when the frame wasn't mapped.
+    float mask_avg;
+};
+
+// The luma mask of a clip: measures the average (or percentile) of every frame, keeps the averages for lag, tr and stats_file, and maps
+// luma to the mask with the output table of the average. The filters decide where the mask goes.
+class adaptive_mask
+{
+    PClip child;
+    // The format of the input clip.
+    VideoInfo vi;
     float luma_scaling;
-    std::vector<float> lut;
+    bool fade;
+    const float* lut;
+    float lut_error;
     bool v8;
+    // Lagged average mode: rows are summed and mapped in blocks of block_rows with the previous frame's average.
+    float lag;
+    int block_rows;
+    // Recent frame averages by frame number, for lag and tr, with the raw minimum and maximum sample (NaN when not measured).
+    struct cached_average
+    {
+        int n;
+        float avg;
+        float range[2];
+    };
+    std::vector<cached_average> averages;
+    std::mutex average_mutex;
+    // Temporal radius: the average of the window centred on window_center, in 2^-40 units so the running total is exact.
+    int tr;
+    int window_center;
+    int64_t window_total;
+    std::mutex window_mutex;
+    // Every avg_sample-th row is summed; 1: every row.
+    int avg_sample;
+    // Frame property with a precomputed average; empty: none.
+    std::string avg_prop;
+    // 0: no statistics props, 1: average and exponent, 2: also min, max and mask average.
+    int props;
+    // The part of the frame that is averaged: stat_crop margins or the letterbox bars found in the frame itself.
+    struct area
+    {
+        int left;
+        int top;
+        int right;
+        int bottom;
+    };
+
+    area crop;
+    bool crop_auto;
+    // Percentile of the luma histogram that drives the curve instead of the mean; negative: the mean.
+    float percentile;
+    // Sidecar file with the averages of earlier runs.
+    std::unique_ptr<stats_file> stats;
+
+    // Output tables kept across frames, most recently used first.
+    struct table_entry
+    {
+        uint32_t key;
+        std::shared_ptr<const std::vector<uint8_t>> data;
+    };
+
+    std::list<table_entry> tables;
+    std::mutex cache_mutex;
+    size_t cache_size;
+    int cache_levels;
+    std::atomic<int64_t> cache_hits;
+    std::atomic<int64_t> cache_misses;
+    std::unique_ptr<thread_pool> pool;
+
+    double (*sum)(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+    // The sum together with the smallest and largest sample (props = 2).
+    double (*sum_range)(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+    void (*histogram)(const uint8_t* srcp, const int src_pitch, const int width, const int height, uint32_t* hist) noexcept;
+    void (*build_table)(void* table, const float* lut, const float temp) noexcept;
+    // nt selects streaming stores. Whether AGM streams at all is decided once in its constructor (stream, from nt or llc_share);
+    // AGM::GetFrame only drops it for unaligned destinations and with props = 2. The mask rows of AGMMerge/AGMGrain never stream.
+    void (*map)(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+    // The float curve without fade, used to fill the float table.
+    void (*float_curve)(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+
+    template <typename T>
+    void fade_table(T* tablep) const noexcept;
+    std::shared_ptr<std::vector<uint8_t>> float_table(const float temp) const;
+    std::shared_ptr<const std::vector<uint8_t>> get_table(float& avg);
+    int strips(const int height) const noexcept;
+    float to_average(const double total, const int width, const int height) const noexcept;
+    double sum_rows(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) const noexcept;
+    double sum_area(const uint8_t* srcp, const int src_pitch, const area& a, const int y0, const int y1, float* minmax) const noexcept;
+    double sum_blocks(const uint8_t* srcp, const int src_pitch, const area& a, const int y0, const int y1, float* minmax) const noexcept;
+    bool black_row(const uint8_t* srcp, const int width) const noexcept;
+    area find_bars(const PVideoFrame& frame) const noexcept;
+    area stat_area(const PVideoFrame& frame) const noexcept;
+    float statistic(const std::vector<uint32_t>& hist, float* minmax) const noexcept;
+    float frame_average(const PVideoFrame& frame, float* bound = nullptr, float* minmax = nullptr);
+    bool prop_average(const PVideoFrame& frame, float& avg, IScriptEnvironment* env) const;
+    bool known_average(const int n, const PVideoFrame& frame, float& avg, float* range, IScriptEnvironment* env);
+    float average_at(const int n, IScriptEnvironment* env);
+    float smoothed_average(const int n, IScriptEnvironment* env);
+    bool find_average(const int n, float& avg, float* range = nullptr);
+    void store_average(const int n, const float avg, const float* range = nullptr);
+    template <typename F>
+    void for_each_strip(const int height, F&& func);
 
-    void (*process)(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
+public:
+    adaptive_mask(PClip child_, const agm_options& o, IScriptEnvironment* env);
+
+    bool has_frame_props() const noexcept { return v8; }
+    bool mask_average() const noexcept { return props == 2; }
+
+    // Measures frame n without mapping it (AGMStats).
+    frame_stats measure(const int n, const PVideoFrame& src, IScriptEnvironment* env);
+    // Maps frame n: map_rows(y, rows, table, temp, mask_sum) is called for every strip (or block of block_rows) of the luma rows, with
+    // the table and exponent of the frame's curve; with props = 2, mask_sum receives the sum of the mask rows, otherwise it is nullptr.
+    template <typename F>
+    frame_stats process(const int n, const PVideoFrame& src, F&& map_rows, IScriptEnvironment* env);
+    // Maps rows [y, y + rows) of srcp to dstp and adds the sum of the mapped rows to mask_sum (when not nullptr).
+    void map_block(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int rows, const void* table, const float temp, const bool nt, double* mask_sum) const noexcept;
+    // Maps the luma rows [y0, y1) of clean one at a time into a row buffer and calls blend(p, row, maskp, width) for the luma row
+    // (p = 0) and, with chroma, for the chroma rows co-sited with it (p = 1: U, 2: V).
+    template <typename F>
+    void mask_rows(const PVideoFrame& clean, const int y0, const int y1, const void* table, const float temp, double* mask_sum, const bool chroma, F&& blend) const;
+    void set_props(PVideoFrame& frame, const frame_stats& s, IScriptEnvironment* env) const;
+};
+
+// Returns the mask.
+class AGM : public GenericVideoFilter
+{
+    adaptive_mask mask;
+    int stream;
+    bool in_place;
 
 public:
-    AGM(PClip child, float luma_scaling_, bool fade, int opt, IScriptEnvironment* env);
+    AGM(PClip child, const agm_options& o, int nt, IScriptEnvironment* env);
     PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env) override;
 
     int __stdcall SetCacheHints(int cachehints, int frame_range) override
     {
-        return cachehints == CACHE_GET_MTMODE ? MT_MULTI_INSTANCE : 0;
+        return cachehints == CACHE_GET_MTMODE ? MT_NICE_FILTER : 0;
     }
 };
 
-template <typename T, bool fade, int peak, int ymin, int y1, int y2, int ymax, int d0, int d1>
-void process_sse2(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
-template <typename T, bool fade, int peak, int ymin, int y1, int y2, int ymax, int d0, int d1>
-void process_avx2(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
-template <typename T, bool fade, int peak, int ymin, int y1, int y2, int ymax, int d0, int d1>
-void process_avx512(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
+// Returns the source frames with only the statistics props.
+class AGMStats : public GenericVideoFilter
+{
+    adaptive_mask mask;
+
+public:
+    AGMStats(PClip child, const agm_options& o, IScriptEnvironment* env);
+    PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env) override;
+
+    int __stdcall SetCacheHints(int cachehints, int frame_range) override
+    {
+        return cachehints == CACHE_GET_MTMODE ? MT_NICE_FILTER : 0;
+    }
+};
+
+// Blends grained over the source by the mask. chroma 0: clean, 1: grained, 2: blended.
+class AGMMerge : public GenericVideoFilter
+{
+    adaptive_mask mask;
+    PClip grain;
+    int chroma;
+    // Blends a row of grained over clean by a row of the mask.
+    void (*merge_row)(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+
+public:
+    AGMMerge(PClip clean, PClip grained, const agm_options& o, int chroma_, IScriptEnvironment* env);
+    PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env) override;
+
+    int __stdcall SetCacheHints(int cachehints, int frame_range) override
+    {
+        return cachehints == CACHE_GET_MTMODE ? MT_NICE_FILTER : 0;
+    }
+};
+
+// Adds grain generated from a hash (noise.h) scaled by the mask. Per plane (luma, chroma) scale of the noise; seed and whether every
+// frame gets the same grain.
+class AGMGrain : public GenericVideoFilter
+{
+    adaptive_mask mask;
+    float noise_scale[2];
+    uint32_t seed;
+    bool constant;
+    bool chroma;
+    // Adds grain scaled by a row of the mask to a row.
+    void (*grain_row)(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+
+public:
+    AGMGrain(PClip child, const agm_options& o, float var, float uvar, int seed_, bool constant_, IScriptEnvironment* env);
+    PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env) override;
+
+    int __stdcall SetCacheHints(int cachehints, int frame_range) override
+    {
+        return cachehints == CACHE_GET_MTMODE ? MT_NICE_FILTER : 0;
+    }
+};
+
+template <typename T, int peak>
+double sum_sse2(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+template <typename T, int peak>
+double sum_avx2(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+template <typename T, int peak>
+double sum_avx512(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+
+template <typename T, int peak>
+double sum_range_sse2(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+template <typename T, int peak>
+double sum_range_avx2(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+template <typename T, int peak>
+double sum_range_avx512(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+
+template <typename T, int peak>
+void merge_row_sse2(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+template <typename T, int peak>
+void merge_row_avx2(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+template <typename T, int peak>
+void merge_row_avx512(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+
+template <typename T, int peak>
+void grain_row_sse2(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+template <typename T, int peak>
+void grain_row_avx2(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+template <typename T, int peak>
+void grain_row_avx512(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+
+template <typename T, int peak>
+void build_table_sse2(void* table, const float* lut, const float temp) noexcept;
+template <typename T, int peak>
+void build_table_avx2(void* table, const float* lut, const float temp) noexcept;
+template <typename T, int peak>
+void build_table_avx512(void* table, const float* lut, const float temp) noexcept;
+
+template <typename T>
+void map_c(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template <typename T>
+void map_avx2(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template <typename T>
+void map_avx512(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+
+void map_shuffle_avx2(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+void map_shuffle_avx512(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+void map_shuffle_avx512vbmi(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+
+template <bool fade, bool fast>
+void map_float_sse2(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template <bool fade, bool fast>
+void map_float_avx2(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template <bool fade, bool fast>
+void map_float_avx512(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template <bool fade, bool fast>
+void map_float_lut_sse2(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template <bool fade, bool fast>
+void map_float_lut_avx2(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template <bool fade, bool fast>
+void map_float_lut_avx512(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
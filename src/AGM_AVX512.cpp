@@ -1,151 +1,301 @@
+#include <algorithm>
+#include <limits>
+
 #include "AGM.h"
 #include "VCL2/vectorclass.h"
 #include "VCL2/vectormath_exp.h"
+#include "map_shuffle.h"
+#include "noise.h"
+#include "pow_fast.h"
 
-template <typename T, int peak>
-AVS_FORCEINLINE float average_plane_avx512(const T* srcp, const int src_pitch, const int width, const int height) noexcept
+template <typename V, typename T>
+AVS_FORCEINLINE void store_avx512(const V& v, T* p, const bool nt) noexcept
+{
+    if (nt)
+        v.store_nt(p);
+    else
+        v.store(p);
+}
+
+// Reduces the running minimum and maximum vectors and the scalar tail into minmax[0..1].
+template <typename V, typename S>
+AVS_FORCEINLINE void store_range_avx512(const V& lo, const V& hi, const S tail_lo, const S tail_hi, float* minmax) noexcept
 {
-    Vec16f accum{ zero_16f() };
+    S l[V::size()];
+    S h[V::size()];
+    lo.store(l);
+    hi.store(h);
+
+    minmax[0] = static_cast<float>(std::min(*std::min_element(l, l + V::size()), tail_lo));
+    minmax[1] = static_cast<float>(std::max(*std::max_element(h, h + V::size()), tail_hi));
+}
+
+// Integer sums are exact: psadbw for 8-bit, pmaddwd into 32-bit lanes flushed to 64-bit for 16-bit.
+// 16-bit samples are biased by -32768 so pmaddwd's signed multiply can't overflow; the bias is added back at the end.
+// With range, the smallest and largest samples are tracked in the same sweep.
+template <typename T, int peak, bool range>
+AVS_FORCEINLINE double sum_plane_avx512(const T* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept
+{
+    T tail_lo{ std::numeric_limits<T>::max() };
+    T tail_hi{ std::numeric_limits<T>::lowest() };
 
     if constexpr (std::is_same_v<T, uint8_t>)
     {
+        const int mod_width{ width & ~63 };
+        Vec8uq accum{ zero_si512() };
+        uint64_t tail{ 0 };
+        Vec64uc lo{ tail_lo };
+        Vec64uc hi{ tail_hi };
+
         for (int y{ 0 }; y < height; ++y)
         {
-            for (int x{ 0 }; x < width; x += 16)
-                accum += to_float(Vec16i().load_16uc(srcp + x));
+            for (int x{ 0 }; x < mod_width; x += 64)
+            {
+                const Vec64uc v{ Vec64uc().load(srcp + x) };
+                accum += Vec8uq(_mm512_sad_epu8(v, zero_si512()));
+
+                if constexpr (range)
+                {
+                    lo = min(lo, v);
+                    hi = max(hi, v);
+                }
+            }
+
+            for (int x{ mod_width }; x < width; ++x)
+            {
+                tail += srcp[x];
+
+                if constexpr (range)
+                {
+                    tail_lo = std::min(tail_lo, srcp[x]);
+                    tail_hi = std::max(tail_hi, srcp[x]);
+                }
+            }
 
             srcp += src_pitch;
         }
 
-        accum = (accum / (width * height)) / peak;
+        if constexpr (range)
+            store_range_avx512(lo, hi, tail_lo, tail_hi, minmax);
+
+        return static_cast<double>(horizontal_add(accum) + tail);
     }
     else if constexpr (std::is_same_v<T, uint16_t>)
     {
+        // Each 32-bit lane gains at most 2 * 32768 per step.
+        constexpr int flush{ 16384 * 32 };
+        constexpr int bias{ (peak > 32767) ? 32768 : 0 };
+
+        const int mod_width{ width & ~31 };
+        int64_t accum{ 0 };
+        uint64_t tail{ 0 };
+        Vec32us lo{ tail_lo };
+        Vec32us hi{ tail_hi };
+
         for (int y{ 0 }; y < height; ++y)
         {
-            for (int x{ 0 }; x < width; x += 16)
-                accum += to_float(Vec16i().load_16us(srcp + x));
+            for (int x{ 0 }; x < mod_width;)
+            {
+                const int end{ std::min(mod_width, x + flush) };
+                Vec16i part{ zero_si512() };
+
+                for (; x < end; x += 32)
+                {
+                    const Vec32us v{ Vec32us().load(srcp + x) };
+                    part += Vec16i(_mm512_madd_epi16(v ^ Vec32us(bias), Vec32s(1)));
+
+                    if constexpr (range)
+                    {
+                        lo = min(lo, v);
+                        hi = max(hi, v);
+                    }
+                }
+
+                accum += horizontal_add_x(part);
+            }
+
+            for (int x{ mod_width }; x < width; ++x)
+            {
+                tail += srcp[x];
+
+                if constexpr (range)
+                {
+                    tail_lo = std::min(tail_lo, srcp[x]);
+                    tail_hi = std::max(tail_hi, srcp[x]);
+                }
+            }
 
             srcp += src_pitch;
         }
 
-        accum = (accum / (width * height)) / peak;
+        if constexpr (range)
+            store_range_avx512(lo, hi, tail_lo, tail_hi, minmax);
+
+        return static_cast<double>(accum + static_cast<int64_t>(bias) * mod_width * height + tail);
     }
     else
     {
+        Vec16f accum{ zero_16f() };
+        Vec16f lo{ tail_lo };
+        Vec16f hi{ tail_hi };
+
+        const int mod_width{ width & ~15 };
+
         for (int y{ 0 }; y < height; ++y)
         {
-            for (int x{ 0 }; x < width; x += 16)
-                accum += Vec16f().load(srcp + x);
+            for (int x{ 0 }; x < mod_width; x += 16)
+            {
+                const Vec16f v{ Vec16f().load(srcp + x) };
+                accum += v;
+
+                if constexpr (range)
+                {
+                    lo = min(lo, v);
+                    hi = max(hi, v);
+                }
+            }
+
+            if (mod_width < width)
+            {
+                accum += Vec16f().load_partial(width - mod_width, srcp + mod_width);
+
+                if constexpr (range)
+                {
+                    for (int x{ mod_width }; x < width; ++x)
+                    {
+                        tail_lo = std::min(tail_lo, srcp[x]);
+                        tail_hi = std::max(tail_hi, srcp[x]);
+                    }
+                }
+            }
 
             srcp += src_pitch;
         }
 
-        accum = accum / (width * height);
+        if constexpr (range)
+            store_range_avx512(lo, hi, tail_lo, tail_hi, minmax);
+
+        return horizontal_add(accum);
     }
+}
 
-    return horizontal_add(accum);
+template <typename T, int peak>
+double sum_avx512(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept
+{
+    return sum_plane_avx512<T, peak, false>(reinterpret_cast<const T*>(srcp), src_pitch / sizeof(T), width, height, nullptr);
 }
 
-template <typename T, bool fade, int peak, int ymin, int y1, int y2, int ymax, int d0, int d1>
-void process_avx512(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept
+template <typename T, int peak>
+double sum_range_avx512(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept
 {
-    const int height{ src->GetHeight() };
+    return sum_plane_avx512<T, peak, true>(reinterpret_cast<const T*>(srcp), src_pitch / sizeof(T), width, height, minmax);
+}
 
-    env->BitBlt(dst->GetWritePtr(), dst->GetPitch(), src->GetReadPtr(), src->GetPitch(), src->GetRowSize(), height);
+template <typename T, int peak>
+void build_table_avx512(void* table, const float* lut, const float temp) noexcept
+{
+    T* __restrict tablep{ reinterpret_cast<T*>(table) };
+    const Vec16f temp_v{ temp };
 
-    const size_t src_pitch{ src->GetPitch() / sizeof(T) };
-    const size_t dst_pitch{ dst->GetPitch() / sizeof(T) };
-    const size_t width{ src->GetRowSize() / sizeof(T) };
-    const T* srcp{ reinterpret_cast<const T*>(src->GetReadPtr()) };
-    T* __restrict dstp{ reinterpret_cast<T*>(dst->GetWritePtr()) };
+    for (int i{ 0 }; i <= peak; i += 16)
+    {
+        if constexpr (std::is_same_v<T, uint8_t>)
+            compress_saturated_s2u(compress_saturated(min(max(truncatei(pow(Vec16f().load(lut + i), temp_v) * peak + 0.5f), zero_si512()), peak), zero_si512()), zero_si512()).get_low().get_low().store(tablep + i);
+        else
+            compress_saturated_s2u(min(max(truncatei(pow(Vec16f().load(lut + i), temp_v) * peak + 0.5f), zero_si512()), peak), zero_si512()).get_low().store(tablep + i);
+    }
+}
 
-    const float avg{ average_plane_avx512<T, peak>(srcp, src_pitch, width, height) };
-    const Vec16f temp{ avg * avg * luma_scaling };
+// The table is read with 32-bit gathers at word offsets and the neighbouring entry is masked off.
+// The table allocation is padded so the last gather stays in bounds.
+template <typename T>
+void map_avx512(uint8_t* dstp_, const int dst_pitch_, const uint8_t* srcp_, const int src_pitch_, const int width, const int height, const void* table, const float temp, const bool nt) noexcept
+{
+    const size_t src_pitch{ src_pitch_ / sizeof(T) };
+    const size_t dst_pitch{ dst_pitch_ / sizeof(T) };
+    const T* srcp{ reinterpret_cast<const T*>(srcp_) };
+    T* dstp{ reinterpret_cast<T*>(dstp_) };
+    const int* tablep{ reinterpret_cast<const int*>(table) };
+    const T* tablet{ reinterpret_cast<const T*>(table) };
+    const int mod_width{ width & ~15 };
 
     for (int y{ 0 }; y < height; ++y)
     {
-        for (size_t x{ 0 }; x < width; x += 16)
+        for (int x{ 0 }; x < mod_width; x += 16)
         {
-            if constexpr (std::is_same_v<T, uint8_t>)
-            {
-                Vec16f srcp_d;
-                srcp_d.insert(0, lut[srcp[x]]);
-                srcp_d.insert(1, lut[srcp[x + 1]]);
-                srcp_d.insert(2, lut[srcp[x + 2]]);
-                srcp_d.insert(3, lut[srcp[x + 3]]);
-                srcp_d.insert(4, lut[srcp[x + 4]]);
-                srcp_d.insert(5, lut[srcp[x + 5]]);
-                srcp_d.insert(6, lut[srcp[x + 6]]);
-                srcp_d.insert(7, lut[srcp[x + 7]]);
-                srcp_d.insert(8, lut[srcp[x + 8]]);
-                srcp_d.insert(9, lut[srcp[x + 9]]);
-                srcp_d.insert(10, lut[srcp[x + 10]]);
-                srcp_d.insert(11, lut[srcp[x + 11]]);
-                srcp_d.insert(12, lut[srcp[x + 12]]);
-                srcp_d.insert(13, lut[srcp[x + 13]]);
-                srcp_d.insert(14, lut[srcp[x + 14]]);
-                srcp_d.insert(15, lut[srcp[x + 15]]);
-
-                if constexpr (fade)
-                {
-                    const auto srcp_vi{ Vec16uc().load(srcp + x) };
+            const auto v{ Vec16i(_mm512_i32gather_epi32(Vec16i().load_16us(srcp + x), tablep, 2)) & 0xFFFF };
+            store_avx512(compress_saturated_s2u(v, zero_si512()).get_low(), dstp + x, nt);
+        }
 
-                    select(!(srcp_vi > ymin), Vec16uc().load(srcp + x),
-                        select(!(srcp_vi != y1), Vec16uc(d0),
-                            select(!(srcp_vi != y2), Vec16uc(d1),
-                                select(!(srcp_vi < ymax), zero_si128(),
-                                    compress_saturated_s2u(compress_saturated(min(max(truncatei(pow(srcp_d, temp) * peak + 0.5f), zero_si512()), peak), zero_si512()), zero_si512()).get_low().get_low())))).store_nt(dstp + x);
-                }
-                else
-                    compress_saturated_s2u(compress_saturated(min(max(truncatei(pow(srcp_d, temp) * peak + 0.5f), zero_si512()), peak), zero_si512()), zero_si512()).get_low().get_low().store_nt(dstp + x);
-            }
-            else if constexpr (std::is_same_v<T, uint16_t>)
-            {
-                Vec16f srcp_d;
-                srcp_d.insert(0, lut[srcp[x]]);
-                srcp_d.insert(1, lut[srcp[x + 1]]);
-                srcp_d.insert(2, lut[srcp[x + 2]]);
-                srcp_d.insert(3, lut[srcp[x + 3]]);
-                srcp_d.insert(4, lut[srcp[x + 4]]);
-                srcp_d.insert(5, lut[srcp[x + 5]]);
-                srcp_d.insert(6, lut[srcp[x + 6]]);
-                srcp_d.insert(7, lut[srcp[x + 7]]);
-                srcp_d.insert(8, lut[srcp[x + 8]]);
-                srcp_d.insert(9, lut[srcp[x + 9]]);
-                srcp_d.insert(10, lut[srcp[x + 10]]);
-                srcp_d.insert(11, lut[srcp[x + 11]]);
-                srcp_d.insert(12, lut[srcp[x + 12]]);
-                srcp_d.insert(13, lut[srcp[x + 13]]);
-                srcp_d.insert(14, lut[srcp[x + 14]]);
-                srcp_d.insert(15, lut[srcp[x + 15]]);
-
-                if constexpr (fade)
-                {
-                    const auto srcp_vi{ Vec16us().load(srcp + x) };
+        for (int x{ mod_width }; x < width; ++x)
+            dstp[x] = tablet[srcp[x]];
 
-                    select(!(srcp_vi > ymin), Vec16us().load(srcp + x),
-                        select(!(srcp_vi != y1), Vec16us(d0),
-                            select(!(srcp_vi != y2), Vec16us(d1),
-                                select(!(srcp_vi < ymax), zero_si256(),
-                                    compress_saturated_s2u(min(max(truncatei(pow(srcp_d, temp) * peak + 0.5f), zero_si512()), peak), zero_si512()).get_low())))).store_nt(dstp + x);
-                }
-                else
-                    compress_saturated_s2u(min(max(truncatei(pow(srcp_d, temp) * peak + 0.5f), zero_si512()), peak), zero_si512()).get_low().store_nt(dstp + x);
-            }
-            else
-            {
-                const auto srcp_d{ Vec16f().load(srcp + x) };
-
-                if constexpr (fade)
-                    select(!(srcp_d != 0.0f), srcp_d,
-                        select(!(srcp_d != 1.0f), Vec16f(0.0f),
-                            min(max(pow(1.0f - (srcp_d * ((srcp_d * ((srcp_d * ((srcp_d * ((srcp_d * 18.188f) - 45.47f)) + 36.624f)) - 9.466f)) + 1.124f)),
-                                temp), zero_16f()), 1.0f))).store_nt(dstp + x);
-                else
-                    min(max(pow(1.0f - (srcp_d * ((srcp_d * ((srcp_d * ((srcp_d * ((srcp_d * 18.188f) - 45.47f)) + 36.624f)) - 9.466f)) + 1.124f)),
-                        temp), zero_16f()), 1.0f).store_nt(dstp + x);
-            }
+        srcp += src_pitch;
+        dstp += dst_pitch;
+    }
+}
+
+void map_shuffle_avx512(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept
+{
+    map_shuffle_512(dstp, dst_pitch, srcp, src_pitch, width, height, table, nt);
+}
+
+template <bool fast>
+AVS_FORCEINLINE Vec16f curve_avx512(const Vec16f srcp_d, const float temp) noexcept
+{
+    const auto base{ 1.0f - (srcp_d * ((srcp_d * ((srcp_d * ((srcp_d * ((srcp_d * 18.188f) - 45.47f)) + 36.624f)) - 9.466f)) + 1.124f)) };
+
+    if constexpr (fast)
+        return min(max(pow_fast(base, temp), zero_16f()), 1.0f);
+    else
+        return min(max(pow(base, Vec16f(temp)), zero_16f()), 1.0f);
+}
+
+template <bool fade>
+AVS_FORCEINLINE Vec16f fade_avx512(const Vec16f srcp_d, const Vec16f mask) noexcept
+{
+    if constexpr (fade)
+        return select(!(srcp_d != 0.0f), srcp_d, select(!(srcp_d != 1.0f), Vec16f(0.0f), mask));
+    else
+        return mask;
+}
+
+// Linear interpolation in the float table; out-of-range (and NaN) pixels are computed directly.
+template <bool fast>
+AVS_FORCEINLINE Vec16f interpolate_avx512(const Vec16f srcp_d, const float* tablep, const int entries, const float temp) noexcept
+{
+    const auto pos{ srcp_d * static_cast<float>(entries) };
+    const auto i{ min(max(truncatei(pos), 0), entries - 1) };
+    const Vec16f lo{ _mm512_i32gather_ps(i, tablep, 4) };
+    const Vec16f hi{ _mm512_i32gather_ps(i, tablep + 1, 4) };
+    const auto in_range{ (srcp_d >= 0.0f) & (srcp_d <= 1.0f) };
+    const auto mask{ mul_add(pos - to_float(i), hi - lo, lo) };
+
+    return (horizontal_and(in_range)) ? mask : select(in_range, mask, curve_avx512<fast>(srcp_d, temp));
+}
+
+// The last partial vector of every row is loaded and stored with masked accesses, so nothing past width is touched.
+template <bool fade, bool fast>
+void map_float_avx512(uint8_t* dstp_, const int dst_pitch_, const uint8_t* srcp_, const int src_pitch_, const int width, const int height, const void* table, const float temp, const bool nt) noexcept
+{
+    const size_t src_pitch{ src_pitch_ / sizeof(float) };
+    const size_t dst_pitch{ dst_pitch_ / sizeof(float) };
+    const float* srcp{ reinterpret_cast<const float*>(srcp_) };
+    float* dstp{ reinterpret_cast<float*>(dstp_) };
+    const int mod_width{ width & ~15 };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < mod_width; x += 16)
+        {
+            const auto srcp_d{ Vec16f().load(srcp + x) };
+            store_avx512(fade_avx512<fade>(srcp_d, curve_avx512<fast>(srcp_d, temp)), dstp + x, nt);
+        }
+
+        if (mod_width < width)
+        {
+            const auto srcp_d{ Vec16f().load_partial(width - mod_width, srcp + mod_width) };
+            fade_avx512<fade>(srcp_d, curve_avx512<fast>(srcp_d, temp)).store_partial(width - mod_width, dstp + mod_width);
         }
 
         srcp += src_pitch;
@@ -153,20 +303,168 @@ void process_avx512(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling
     }
 }
 
-template void process_avx512<uint8_t, true, 255, 16, 17, 18, 235, 85, 170>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
-template void process_avx512<uint8_t, false, 255, 16, 17, 18, 235, 85, 170>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
+template <bool fade, bool fast>
+void map_float_lut_avx512(uint8_t* dstp_, const int dst_pitch_, const uint8_t* srcp_, const int src_pitch_, const int width, const int height, const void* table, const float temp, const bool nt) noexcept
+{
+    const int entries{ *reinterpret_cast<const int*>(table) };
+
+    if (!entries)
+    {
+        map_float_avx512<fade, fast>(dstp_, dst_pitch_, srcp_, src_pitch_, width, height, table, temp, nt);
+        return;
+    }
+
+    const size_t src_pitch{ src_pitch_ / sizeof(float) };
+    const size_t dst_pitch{ dst_pitch_ / sizeof(float) };
+    const float* srcp{ reinterpret_cast<const float*>(srcp_) };
+    float* dstp{ reinterpret_cast<float*>(dstp_) };
+    const float* tablep{ reinterpret_cast<const float*>(table) + 1 };
+    const int mod_width{ width & ~15 };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < mod_width; x += 16)
+        {
+            const auto srcp_d{ Vec16f().load(srcp + x) };
+            store_avx512(fade_avx512<fade>(srcp_d, interpolate_avx512<fast>(srcp_d, tablep, entries, temp)), dstp + x, nt);
+        }
+
+        if (mod_width < width)
+        {
+            const auto srcp_d{ Vec16f().load_partial(width - mod_width, srcp + mod_width) };
+            fade_avx512<fade>(srcp_d, interpolate_avx512<fast>(srcp_d, tablep, entries, temp)).store_partial(width - mod_width, dstp + mod_width);
+        }
+
+        srcp += src_pitch;
+        dstp += dst_pitch;
+    }
+}
+
+// Integer blends are exact: 16-bit lanes for 8-bit, 32-bit lanes for 10..16-bit, and the division by peak is a multiply by a constant.
+template <typename T, int peak>
+void merge_row_avx512(uint8_t* dstp_, const uint8_t* cleanp_, const uint8_t* grainp_, const uint8_t* maskp_, const int width) noexcept
+{
+    T* dstp{ reinterpret_cast<T*>(dstp_) };
+    const T* cleanp{ reinterpret_cast<const T*>(cleanp_) };
+    const T* grainp{ reinterpret_cast<const T*>(grainp_) };
+    const T* maskp{ reinterpret_cast<const T*>(maskp_) };
+
+    if constexpr (std::is_same_v<T, float>)
+    {
+        const int mod_width{ width & ~15 };
+
+        for (int x{ 0 }; x < mod_width; x += 16)
+        {
+            const Vec16f c{ Vec16f().load(cleanp + x) };
+            mul_add(Vec16f().load(grainp + x) - c, Vec16f().load(maskp + x), c).store(dstp + x);
+        }
+
+        for (int x{ mod_width }; x < width; ++x)
+            dstp[x] = cleanp[x] + (grainp[x] - cleanp[x]) * maskp[x];
+    }
+    else
+    {
+        using V = std::conditional_t<std::is_same_v<T, uint8_t>, Vec64uc, Vec32us>;
+        using W = std::conditional_t<std::is_same_v<T, uint8_t>, Vec32us, Vec16ui>;
+
+        const auto blend{ [](const W c, const W g, const W m) { return (c * (W(peak) - m) + g * m + W(peak / 2)) / const_uint(peak); } };
+        const int mod_width{ width & ~(V::size() - 1) };
+
+        for (int x{ 0 }; x < mod_width; x += V::size())
+        {
+            const V c{ V().load(cleanp + x) };
+            const V g{ V().load(grainp + x) };
+            const V m{ V().load(maskp + x) };
+            compress(blend(extend_low(c), extend_low(g), extend_low(m)), blend(extend_high(c), extend_high(g), extend_high(m))).store(dstp + x);
+        }
+
+        for (int x{ mod_width }; x < width; ++x)
+            dstp[x] = static_cast<T>((static_cast<uint32_t>(cleanp[x]) * (peak - maskp[x]) + static_cast<uint32_t>(grainp[x]) * maskp[x] + peak / 2) / peak);
+    }
+}
+
+// Adds grain scaled by the mask to a row: src + noise * mask * scale, rounded and clamped for integer formats.
+template <typename T, int peak>
+void grain_row_avx512(uint8_t* dstp_, const uint8_t* srcp_, const uint8_t* maskp_, const int width, const uint32_t key, const float scale) noexcept
+{
+    T* dstp{ reinterpret_cast<T*>(dstp_) };
+    const T* srcp{ reinterpret_cast<const T*>(srcp_) };
+    const T* maskp{ reinterpret_cast<const T*>(maskp_) };
+    const Vec16ui lanes{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    const int mod_width{ width & ~15 };
+
+    for (int x{ 0 }; x < mod_width; x += 16)
+    {
+        const Vec16f noise{ to_float(Vec16i(noise_sample(noise_hash(Vec16ui(key + x) + lanes)))) };
+
+        if constexpr (std::is_same_v<T, float>)
+            mul_add(noise * Vec16f().load(maskp + x), scale, Vec16f().load(srcp + x)).store(dstp + x);
+        else
+        {
+            const Vec16f src{ to_float((std::is_same_v<T, uint8_t>) ? Vec16i().load_16uc(srcp + x) : Vec16i().load_16us(srcp + x)) };
+            const Vec16f mask{ to_float((std::is_same_v<T, uint8_t>) ? Vec16i().load_16uc(maskp + x) : Vec16i().load_16us(maskp + x)) };
+            const Vec16i r{ truncatei(min(max(mul_add(noise * mask, scale, src), 0.0f), static_cast<float>(peak)) + 0.5f) };
+
+            if constexpr (std::is_same_v<T, uint8_t>)
+                compress_saturated_s2u(compress_saturated(r, zero_si512()), zero_si512()).get_low().get_low().store(dstp + x);
+            else
+                compress_saturated_s2u(r, zero_si512()).get_low().store(dstp + x);
+        }
+    }
+
+    for (int x{ mod_width }; x < width; ++x)
+    {
+        const float v{ static_cast<float>(static_cast<int32_t>(noise_sample(noise_hash(key + x)))) * maskp[x] * scale + srcp[x] };
+
+        if constexpr (std::is_same_v<T, float>)
+            dstp[x] = v;
+        else
+            dstp[x] = static_cast<T>(std::clamp(v, 0.0f, static_cast<float>(peak)) + 0.5f);
+    }
+}
+
+template double sum_avx512<uint8_t, 255>(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+template double sum_avx512<uint16_t, 1023>(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+template double sum_avx512<uint16_t, 4095>(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+template double sum_avx512<uint16_t, 16383>(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+template double sum_avx512<uint16_t, 65535>(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+template double sum_avx512<float, 0>(const uint8_t* srcp, const int src_pitch, const int width, const int height) noexcept;
+
+template double sum_range_avx512<uint8_t, 255>(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+template double sum_range_avx512<uint16_t, 1023>(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+template double sum_range_avx512<uint16_t, 4095>(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+template double sum_range_avx512<uint16_t, 16383>(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+template double sum_range_avx512<uint16_t, 65535>(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+template double sum_range_avx512<float, 0>(const uint8_t* srcp, const int src_pitch, const int width, const int height, float* minmax) noexcept;
+
+template void build_table_avx512<uint8_t, 255>(void* table, const float* lut, const float temp) noexcept;
+template void build_table_avx512<uint16_t, 1023>(void* table, const float* lut, const float temp) noexcept;
+template void build_table_avx512<uint16_t, 4095>(void* table, const float* lut, const float temp) noexcept;
+template void build_table_avx512<uint16_t, 16383>(void* table, const float* lut, const float temp) noexcept;
+template void build_table_avx512<uint16_t, 65535>(void* table, const float* lut, const float temp) noexcept;
 
-template void process_avx512<uint16_t, true, 1023, 64, 68, 72, 940, 340, 680>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
-template void process_avx512<uint16_t, false, 1023, 64, 68, 72, 940, 340, 680>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
+template void map_avx512<uint16_t>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
 
-template void process_avx512<uint16_t, true, 4095, 256, 272, 288, 3760, 1360, 2720>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
-template void process_avx512<uint16_t, false, 4095, 256, 272, 288, 3760, 1360, 2720>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
+template void map_float_avx512<true, true>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template void map_float_avx512<true, false>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template void map_float_avx512<false, true>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template void map_float_avx512<false, false>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
 
-template void process_avx512<uint16_t, true, 16383, 1024, 1088, 1152, 15040, 5440, 10880>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
-template void process_avx512<uint16_t, false, 16383, 1024, 1088, 1152, 15040, 5440, 10880>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
+template void map_float_lut_avx512<true, true>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template void map_float_lut_avx512<true, false>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template void map_float_lut_avx512<false, true>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
+template void map_float_lut_avx512<false, false>(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept;
 
-template void process_avx512<uint16_t, true, 65535, 4096, 4352, 4608, 60160, 21760, 43520>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
-template void process_avx512<uint16_t, false, 65535, 4096, 4352, 4608, 60160, 21760, 43520>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
+template void merge_row_avx512<uint8_t, 255>(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+template void merge_row_avx512<uint16_t, 1023>(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+template void merge_row_avx512<uint16_t, 4095>(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+template void merge_row_avx512<uint16_t, 16383>(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+template void merge_row_avx512<uint16_t, 65535>(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
+template void merge_row_avx512<float, 0>(uint8_t* dstp, const uint8_t* cleanp, const uint8_t* grainp, const uint8_t* maskp, const int width) noexcept;
 
-template void process_avx512<float, true, 0, 0, 0, 0, 0, 0, 0>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
-template void process_avx512<float, false, 0, 0, 0, 0, 0, 0, 0>(PVideoFrame& dst, PVideoFrame& src, const float luma_scaling, std::vector<float>& lut, IScriptEnvironment* env) noexcept;
+template void grain_row_avx512<uint8_t, 255>(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+template void grain_row_avx512<uint16_t, 1023>(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+template void grain_row_avx512<uint16_t, 4095>(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+template void grain_row_avx512<uint16_t, 16383>(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+template void grain_row_avx512<uint16_t, 65535>(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
+template void grain_row_avx512<float, 0>(uint8_t* dstp, const uint8_t* srcp, const uint8_t* maskp, const int width, const uint32_t key, const float scale) noexcept;
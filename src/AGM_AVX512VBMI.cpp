@@ -0,0 +1,8 @@
+#include "AGM.h"
+#include "VCL2/vectorclass.h"
+#include "map_shuffle.h"
+
+void map_shuffle_avx512vbmi(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const float temp, const bool nt) noexcept
+{
+    map_shuffle_512(dstp, dst_pitch, srcp, src_pitch, width, height, table, nt);
+}
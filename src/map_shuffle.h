@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+// 8-bit lookups stay in registers: the whole table is held in four zmm and indexed with a byte permute.
+// Shared by AGM_AVX512.cpp (byte permute emulated with word permutes) and AGM_AVX512VBMI.cpp (two vpermi2b and a blend);
+// static so each file keeps the copy built with its own flags. Needs vectorclass.h.
+static inline void map_shuffle_512(uint8_t* dstp, const int dst_pitch, const uint8_t* srcp, const int src_pitch, const int width, const int height, const void* table, const bool nt) noexcept
+{
+    const uint8_t* tablep{ reinterpret_cast<const uint8_t*>(table) };
+    const int mod_width{ width & ~63 };
+
+    const auto t0{ Vec64c().load(tablep) };
+    const auto t1{ Vec64c().load(tablep + 64) };
+    const auto t2{ Vec64c().load(tablep + 128) };
+    const auto t3{ Vec64c().load(tablep + 192) };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < mod_width; x += 64)
+        {
+            const auto v{ lookup256(Vec64c().load(srcp + x), t0, t1, t2, t3) };
+
+            if (nt)
+                v.store_nt(dstp + x);
+            else
+                v.store(dstp + x);
+        }
+
+        for (int x{ mod_width }; x < width; ++x)
+            dstp[x] = tablep[srcp[x]];
+
+        srcp += src_pitch;
+        dstp += dst_pitch;
+    }
+}
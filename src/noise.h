@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+// Counter-based grain noise for AGMGrain: every sample is hashed from (seed, frame, plane, row, column), so frames can be
+// generated in any order and with any number of threads and always get the same grain.
+// The hash is lowbias32 (Chris Wellons); V is uint32_t or a VCL unsigned 32-bit vector.
+template <typename V>
+static inline V noise_hash(V x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// The sum of the four bytes of a hash minus its mean: approximately Gaussian (Irwin-Hall with n = 4), range [-510, 510],
+// standard deviation sqrt(4 * (256 * 256 - 1) / 12) = noise_sd.
+template <typename V>
+static inline V noise_sample(const V h)
+{
+    const V t{ (h & 0x00FF00FFu) + ((h >> 8) & 0x00FF00FFu) };
+    return (t & 0xFFFFu) + (t >> 16) - 510u;
+}
+
+constexpr float noise_sd{ 147.8005f };
+
+// Row key: the hash of column x is noise_hash(key + x).
+static inline uint32_t noise_key(const uint32_t seed, const int n, const int plane, const int y)
+{
+    return noise_hash(noise_hash(noise_hash(seed ^ 0x9E3779B9u) ^ static_cast<uint32_t>(n)) + static_cast<uint32_t>(plane) * 0x85EBCA6Bu + static_cast<uint32_t>(y) * 0xC2B2AE35u);
+}
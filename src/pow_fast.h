@@ -0,0 +1,33 @@
+#pragma once
+
+// pow for the float mask: x is the curve output (normally 0..1) and y the per-frame exponent.
+// Computed as exp2(y * log2(x)) with short polynomials and none of the special cases of VCL's pow.
+// log2: mantissa in [sqrt(0.5), sqrt(2)), log2(1 + f) = f * P7(f). exp2: round to nearest, 2^r = 1 + r * P5(r).
+// Valid for y >= 0 only (luma_scaling is checked in the constructor); negative y isn't handled.
+// Against double pow over x in (0, 1] (subnormals included), y in [0, 1000]: max absolute error 1.5e-7,
+// max relative error 2.5e-6 (~40 ULP) where the result is at least 1e-3.
+// x <= 0 gives 0 (1 when y is 0); results below 2^-126 are flushed to 0 and results above 2 are capped at 2 (the caller clamps to 1).
+// Needs vectormath_exp.h (fraction_2, exponent_f, vm_pow2n).
+template <typename VTYPE>
+static inline VTYPE pow_fast(const VTYPE x, const float y)
+{
+    // Subnormal x is scaled by 2^23 first: exponent_f doesn't see their leading zeros.
+    const auto subnormal{ x < 1.17549435e-38f };
+    const VTYPE xn{ if_mul(subnormal, x, 8388608.0f) };
+    auto m{ fraction_2(xn) };
+    auto e{ if_add(subnormal, exponent_f(xn), -23.0f) };
+
+    const auto blend{ m > static_cast<float>(VM_SQRT2 * 0.5) };
+    m = if_add(!blend, m, m);
+    e = if_add(blend, e, 1.0f);
+
+    const VTYPE f{ m - 1.0f };
+    const VTYPE lg{ mul_add(f, polynomial_7(f, 1.442694995f, -0.7213529314f, 0.4809167080f, -0.3602251825f, 0.2872888824f, -0.2492718221f, 0.2326525788f, -0.1427597344f), e) };
+
+    const VTYPE t{ min(lg * y, 1.0f) };
+    const VTYPE n{ round(t) };
+    const VTYPE r{ t - n };
+    const VTYPE z{ mul_add(r, polynomial_5(r, 0.6931471880f, 0.2402265076f, 0.05550357114f, 0.009618082557f, 0.001339086336f, 0.0001545316294f), 1.0f) * vm_pow2n(n) };
+
+    return select((x > 0.0f) & (t > -126.0f), z, VTYPE((y == 0.0f) ? 1.0f : 0.0f));
+}
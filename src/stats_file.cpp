@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "stats_file.h"
+
+stats_file::~stats_file()
+{
+#ifdef _WIN32
+    if (view)
+        UnmapViewOfFile(view);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file)
+        CloseHandle(file);
+#else
+    if (view)
+        munmap(view, size);
+    if (fd != -1)
+        close(fd);
+#endif
+}
+
+stats_file::status stats_file::open(const char* path, const header& id)
+{
+    frames = id.num_frames;
+    size = sizeof(header) + sizeof(float) * 3 * frames;
+
+#ifdef _WIN32
+    // Shared for writing like the POSIX path, so several scripts (or preview and encode) can use the same file at once.
+    HANDLE h{ CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr) };
+    if (h == INVALID_HANDLE_VALUE)
+        return status::io_error;
+
+    file = h;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(h, &file_size))
+        return status::io_error;
+
+    // Only an empty file is grown; any other size belongs to another clip.
+    if (file_size.QuadPart == 0)
+    {
+        LARGE_INTEGER end;
+        end.QuadPart = size;
+        if (!SetFilePointerEx(h, end, nullptr, FILE_BEGIN) || !SetEndOfFile(h))
+            return status::io_error;
+    }
+    else if (static_cast<size_t>(file_size.QuadPart) != size)
+        return status::mismatch;
+
+    mapping = CreateFileMappingA(h, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size), nullptr);
+    if (!mapping)
+        return status::io_error;
+
+    view = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+    if (!view)
+        return status::io_error;
+#else
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return status::io_error;
+
+    struct stat st;
+    if (fstat(fd, &st))
+        return status::io_error;
+
+    // Only an empty file is grown; shrinking a file that another process has mapped would fault its accesses.
+    if (st.st_size == 0)
+    {
+        if (ftruncate(fd, size))
+            return status::io_error;
+    }
+    else if (static_cast<size_t>(st.st_size) != size)
+        return status::mismatch;
+
+    void* p{ mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) };
+    if (p == MAP_FAILED)
+        return status::io_error;
+
+    view = static_cast<uint8_t*>(p);
+#endif
+
+    // An all-zero header is a file that was just created (here or by another process) and not initialized yet.
+    const header empty{};
+    if (!memcmp(view, &empty, sizeof(header)))
+    {
+        std::fill_n(record(0), static_cast<size_t>(frames) * 3, std::numeric_limits<float>::quiet_NaN());
+        memcpy(view, &id, sizeof(header));
+    }
+    else if (memcmp(view, &id, sizeof(header)))
+        return status::mismatch;
+
+    return status::ok;
+}
+
+bool stats_file::get(const int n, float& avg, float* range) const noexcept
+{
+    if (n < 0 || n >= frames)
+        return false;
+
+    const float* r{ record(n) };
+    if (std::isnan(r[0]))
+        return false;
+
+    avg = r[0];
+    if (range)
+    {
+        range[0] = r[1];
+        range[1] = r[2];
+    }
+
+    return true;
+}
+
+void stats_file::set(const int n, const float avg, const float* range) noexcept
+{
+    if (n < 0 || n >= frames)
+        return;
+
+    float* r{ record(n) };
+    r[1] = (range) ? range[0] : std::numeric_limits<float>::quiet_NaN();
+    r[2] = (range) ? range[1] : std::numeric_limits<float>::quiet_NaN();
+    r[0] = avg;
+}
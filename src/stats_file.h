@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Per-frame averages kept in a memory-mapped file across runs: a header identifying the clip followed by three floats per frame,
+// the average and the smallest and largest raw sample (props = 2). Values that haven't been measured yet hold NaN.
+// An existing file is never truncated or rewritten (another process may have it mapped): one whose size or header doesn't match
+// the clip is refused. Only a new or empty file, or one whose header is still all zero, is initialized.
+class stats_file
+{
+public:
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t num_frames;
+        int32_t pixel_type;
+        uint32_t fps_numerator;
+        uint32_t fps_denominator;
+        int32_t avg_sample;
+        // 0: mean, otherwise 1 + the percentile * 1000.
+        uint32_t stat;
+        // Keeps fingerprint at offset 48 without compiler padding; always 0.
+        uint32_t reserved{ 0 };
+        // FNV-1a of a few rows of the first frame.
+        uint64_t fingerprint;
+    };
+
+    // The header is compared and written byte for byte, so its layout must not depend on the compiler.
+    static_assert(sizeof(header) == 56, "stats_file::header must be 56 bytes");
+
+    stats_file() noexcept = default;
+    stats_file(const stats_file&) = delete;
+    stats_file& operator=(const stats_file&) = delete;
+    ~stats_file();
+
+    enum class status
+    {
+        ok,
+        io_error,
+        mismatch,
+    };
+
+    // Maps the file, creating it when it doesn't exist; mismatch when it was written for another clip.
+    status open(const char* path, const header& id);
+    // range (optional) receives the minimum and maximum; NaN when the frame was averaged without them.
+    bool get(const int n, float& avg, float* range = nullptr) const noexcept;
+    void set(const int n, const float avg, const float* range = nullptr) noexcept;
+
+private:
+    uint8_t* view{ nullptr };
+    size_t size{ 0 };
+    int frames{ 0 };
+#ifdef _WIN32
+    void* file{ nullptr };
+    void* mapping{ nullptr };
+#else
+    int fd{ -1 };
+#endif
+
+    float* record(const int n) const noexcept { return reinterpret_cast<float*>(view + sizeof(header)) + static_cast<size_t>(n) * 3; }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Minimal fork-join pool: run() hands out job indices to the workers and the calling thread and returns when all are done.
+class thread_pool
+{
+    std::vector<std::thread> workers;
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    const std::function<void(int)>* job;
+    int count;
+    std::atomic<int> next;
+    int active;
+    uint64_t generation;
+    bool stop;
+
+    void work() noexcept
+    {
+        for (int i{ next++ }; i < count; i = next++)
+            (*job)(i);
+    }
+
+    void worker_loop() noexcept
+    {
+        uint64_t seen{ 0 };
+
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cv.wait(lock, [&] { return stop || generation != seen; });
+
+                if (stop)
+                    return;
+
+                seen = generation;
+            }
+
+            work();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--active == 0)
+                done_cv.notify_one();
+        }
+    }
+
+public:
+    explicit thread_pool(const int threads)
+        : job(nullptr), count(0), next(0), active(0), generation(0), stop(false)
+    {
+        for (int i{ 1 }; i < threads; ++i)
+            workers.emplace_back(&thread_pool::worker_loop, this);
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+
+        start_cv.notify_all();
+
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    int size() const noexcept
+    {
+        return static_cast<int>(workers.size()) + 1;
+    }
+
+    void run(const int count_, const std::function<void(int)>& job_)
+    {
+        std::lock_guard<std::mutex> run_lock(run_mutex);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &job_;
+            count = count_;
+            next = 0;
+            active = static_cast<int>(workers.size());
+            ++generation;
+        }
+
+        start_cv.notify_all();
+        work();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&] { return active == 0; });
+    }
+};